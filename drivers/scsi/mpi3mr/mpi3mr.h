@@ -19,6 +19,7 @@
 #include <linux/init.h>
 #include <linux/io.h>
 #include <linux/interrupt.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
 #include <linux/kernel.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
@@ -81,6 +82,21 @@ extern struct list_head mrioc_list;
 #define MPI3MR_OP_REP_Q_QD		4096
 #define MPI3MR_OP_REQ_Q_SEG_SIZE	4096
 #define MPI3MR_OP_REP_Q_SEG_SIZE	4096
+/* Reply descriptors processed between consumer index publications */
+#define MPI3MR_OP_REP_Q_CI_BATCH	64
+/*
+ * Reply queue occupancy, in percent of the queue depth, above which
+ * the consumer index is published every MPI3MR_OP_REP_Q_CI_WMARK_BATCH
+ * descriptors
+ */
+#define MPI3MR_OP_REP_Q_FILL_WMARK_PCT	75
+#define MPI3MR_OP_REP_Q_CI_WMARK_BATCH	8
+/* Reply frames returned to the firmware at once */
+#define MPI3MR_REPOST_BATCH		16
+/* Number of SCSI sense keys */
+#define MPI3MR_NUM_SENSE_KEYS		16
+/* Longest per queue line of the reply queue statistics */
+#define MPI3MR_STATS_LINE_SZ		160
 #define MPI3MR_MAX_SEG_LIST_SIZE	4096
 
 /* Reserved Host Tag definitions */
@@ -104,13 +120,35 @@ extern struct list_head mrioc_list;
 #define MPI3MR_PORTENABLE_TIMEOUT		300
 #define MPI3MR_ABORTTM_TIMEOUT			30
 #define MPI3MR_RESETTM_TIMEOUT			30
+#define MPI3MR_SAS_SATA_IO_TIMEOUT		30
+#define MPI3MR_NVME_IO_TIMEOUT			15
+#define MPI3MR_VD_IO_TIMEOUT			90
+#define MPI3MR_VD_DEGRADED_IO_TIMEOUT		180
+#define MPI3MR_INT_RESET_MAX_TIMEOUT		180
 #define MPI3MR_RESET_HOST_IOWAIT_TIMEOUT	5
+#define MPI3MR_PREPARE_FOR_RESET_TIMEOUT	180
+#define MPI3MR_DISCOVERY_TIMEOUT		120
+
+/* Commands queried individually per lost command query pass */
+#define MPI3MR_LOST_IO_MAX_QUERIES		256
 #define MPI3MR_TSUPDATE_INTERVAL		900
 #define MPI3MR_DEFAULT_SHUTDOWN_TIME		120
 #define	MPI3MR_RAID_ERRREC_RESET_TIMEOUT	180
 
 #define MPI3MR_WATCHDOG_INTERVAL		1000 /* in milli seconds */
 
+/* Driver generated event, refresh target devices after a reset */
+#define MPI3MR_DRV_EVENT_TGT_REFRESH		(0xFFFE)
+
+/* Number of IO unit ports tracked for discovery and enumeration */
+#define MPI3MR_NUM_IOU_PORTS			256
+
+/* Driver generated event, discovery or enumeration timed out */
+#define MPI3MR_DRV_EVENT_DISC_TIMEOUT		(0xFFFD)
+
+/* Number of controller reset records retained in the history */
+#define MPI3MR_RESET_HISTORY_SZ			16
+
 /* Internal admin command state definitions*/
 #define MPI3MR_CMD_NOTUSED	0x8000
 #define MPI3MR_CMD_COMPLETE	0x0001
@@ -148,9 +186,45 @@ extern struct list_head mrioc_list;
 /* Command retry count definitions */
 #define MPI3MR_DEV_RMHS_RETRY_COUNT 3
 
+/* Driver requeues of a command failed with a transient error */
+#define MPI3MR_HOST_RETRY_MAX	3
+
+/*
+ * Controller I/O budget fair sharing: minimum share of a LUN
+ * and the fraction of host tags kept as borrowing headroom
+ */
+#define MPI3MR_IO_SHARE_MIN		8
+#define MPI3MR_IO_BUDGET_HEADROOM	8
+
+/*
+ * Target I/O admission state bits, any bit set diverts the
+ * submission to the slow path in mpi3mr_qcmd()
+ */
+#define MPI3MR_TGT_IO_NO_HANDLE		0
+#define MPI3MR_TGT_IO_REMOVED		1
+#define MPI3MR_TGT_IO_BLOCKED		2
+#define MPI3MR_TGT_IO_HOST_RESET	3
+#define MPI3MR_TGT_IO_HOST_STOP		4
+
+/* Cascaded expander levels walked for expander topology changes */
+#define MPI3MR_MAX_EXP_CASCADE		16
+
+/* Degraded volume I/O policy defaults */
+#define MPI3MR_VD_DEGRADED_QD_PCT	50
+#define MPI3MR_VD_DEGRADED_MAX_SECTORS	512
+
+/* Number of volume states tracked, indexed by MPI3_DEVICE0_VD_STATE_* */
+#define MPI3MR_VD_STATE_COUNT	4
+
 /* Default target device queue depth */
 #define MPI3MR_DEFAULT_SDEV_QD	32
 
+/* Concurrent positioning ranges VPD page definitions */
+#define MPI3MR_VPD_CPR_PAGE		0xb9
+#define MPI3MR_VPD_CPR_HDR_LEN		64
+#define MPI3MR_VPD_CPR_DESC_LEN		32
+#define MPI3MR_MAX_ACTUATOR_RANGES	8
+
 /* Definitions for Threaded IRQ poll*/
 #define MPI3MR_IRQ_POLL_SLEEP			2
 #define MPI3MR_IRQ_POLL_TRIGGER_IOCOUNT		8
@@ -210,6 +284,42 @@ enum mpi3mr_reset_reason {
 	MPI3MR_RESET_FROM_SYSFS_TIMEOUT = 24
 };
 
+/* Controller reset phase definitions used for reset history */
+enum mpi3mr_reset_phase {
+	MPI3MR_RESET_PHASE_IO_BLOCK = 0,
+	MPI3MR_RESET_PHASE_FW_RESET,
+	MPI3MR_RESET_PHASE_READY,
+	MPI3MR_RESET_PHASE_QUEUE_CREATE,
+	MPI3MR_RESET_PHASE_PORT_ENABLE,
+	MPI3MR_RESET_PHASE_FW_SETTLE,
+	MPI3MR_RESET_PHASE_IO_RESUME,
+	MPI3MR_RESET_PHASE_MAX
+};
+
+/**
+ * struct mpi3mr_reset_record - Controller reset history record
+ *
+ * @seq: Reset sequence number since driver load
+ * @start_time: Wall clock time (seconds) the reset started
+ * @reset_reason: Reset reason code
+ * @reset_type: Reset type (soft or diag fault)
+ * @success: Reset outcome, 1 on successful recovery
+ * @flush_io_count: Number of host I/Os flushed by the reset, or
+ *                  left outstanding by a diag fault reset
+ * @total_ms: Total time taken by the reset in milliseconds
+ * @phase_ms: Time taken by each reset phase in milliseconds
+ */
+struct mpi3mr_reset_record {
+	u32 seq;
+	time64_t start_time;
+	u32 reset_reason;
+	u16 reset_type;
+	u8 success;
+	u32 flush_io_count;
+	u32 total_ms;
+	u32 phase_ms[MPI3MR_RESET_PHASE_MAX];
+};
+
 /**
  * struct mpi3mr_compimg_ver - replica of component image
  * version defined in mpi30_image.h in host endianness
@@ -291,6 +401,8 @@ struct segments {
  * @q_segments: Segment descriptor pointer
  * @q_segment_list: Segment list base virtual address
  * @q_segment_list_dma: Segment list base DMA address
+ * @io_seq: Sequence number of the last SCSI I/O posted, protected
+ * by @q_lock
  */
 struct op_req_qinfo {
 	u16 ci;
@@ -304,6 +416,7 @@ struct op_req_qinfo {
 	struct segments *q_segments;
 	void *q_segment_list;
 	dma_addr_t q_segment_list_dma;
+	u32 io_seq;
 };
 
 /**
@@ -321,6 +434,12 @@ struct op_req_qinfo {
  * @pend_ios: Number of IOs pending in HW for this queue
  * @enable_irq_poll: Flag to indicate polling is enabled
  * @in_use: Queue is handled by poll/ISR
+ * @fill_wmark: Queue occupancy watermark for early publication
+ * @max_drain: Most reply descriptors processed in one pass
+ * @deep_drains: Passes that published the consumer index early
+ * @ci_updates: Number of consumer index publications
+ * @wmark_updates: Publications triggered by the fill watermark
+ * @sense_keys: Check conditions completed per sense key
  */
 struct op_reply_qinfo {
 	u16 ci;
@@ -335,6 +454,12 @@ struct op_reply_qinfo {
 	atomic_t pend_ios;
 	bool enable_irq_poll;
 	atomic_t in_use;
+	u32 fill_wmark;
+	u32 max_drain;
+	u32 deep_drains;
+	u64 ci_updates;
+	u64 wmark_updates;
+	u64 sense_keys[MPI3MR_NUM_SENSE_KEYS];
 };
 
 /**
@@ -387,9 +512,13 @@ struct tgt_dev_pcie {
  * cached from firmware given data
  *
  * @state: State of the VD
+ * @state_ts: Time in jiffies the VD entered the state, 0 if unset
+ * @state_time: Time in milliseconds spent in each earlier state
  */
 struct tgt_dev_volume {
 	u8 state;
+	unsigned long state_ts;
+	u64 state_time[MPI3MR_VD_STATE_COUNT];
 };
 
 /**
@@ -417,6 +546,10 @@ union _form_spec_inf {
  * @is_hidden: Should be exposed to upper layers or not
  * @host_exposed: Already exposed to host or not
  * @q_depth: Device specific Queue Depth
+ * @qd_refresh: Firmware queue depth changed since it was applied
+ * @abort_to: User set abort TM timeout, 0 for default
+ * @reset_to: User set Target/LUN reset TM timeout, 0 for default
+ * @qd_changes: Number of queue depth changes applied
  * @wwid: World wide ID
  * @dev_spec: Device type specific information
  * @ref_count: Reference count
@@ -433,6 +566,10 @@ struct mpi3mr_tgt_dev {
 	u8 is_hidden;
 	u8 host_exposed;
 	u16 q_depth;
+	u8 qd_refresh;
+	u8 abort_to;
+	u8 reset_to;
+	u32 qd_changes;
 	u64 wwid;
 	union _form_spec_inf dev_spec;
 	struct kref ref_count;
@@ -471,11 +608,26 @@ static inline void mpi3mr_tgtdev_put(struct mpi3mr_tgt_dev *s)
 	kref_put(&s->ref_count, mpi3mr_free_tgtdev);
 }
 
+/**
+ * mpi3mr_tgtdev_is_expander - Check for a SAS expander
+ * @s: Target device reference
+ *
+ * Return: true when the target device is a SAS expander.
+ */
+static inline bool mpi3mr_tgtdev_is_expander(struct mpi3mr_tgt_dev *s)
+{
+	return (s->dev_type == MPI3_DEVICE_DEVFORM_SAS_SATA) &&
+	    ((s->dev_spec.sas_sata_inf.dev_info &
+	    MPI3_SAS_DEVICE_INFO_DEVICE_TYPE_MASK) ==
+	    MPI3_SAS_DEVICE_INFO_DEVICE_TYPE_EXPANDER);
+}
+
 
 /**
  * struct mpi3mr_stgt_priv_data - SCSI target private structure
  *
  * @starget: Scsi_target pointer
+ * @io_state: I/O admission state bits, zero when I/O can be issued
  * @dev_handle: FW device handle
  * @perst_id: FW assigned Persistent ID
  * @num_luns: Number of Logical Units
@@ -484,9 +636,21 @@ static inline void mpi3mr_tgtdev_put(struct mpi3mr_tgt_dev *s)
  * @dev_removedelay: Device is waiting to be removed in FW
  * @dev_type: Device type
  * @tgt_dev: Internal target device pointer
+ * @io_block_work: Applies the block state to the request queues
+ * of the target devices
+ * @q_io_pend: Commands in driver scope per operational queue
+ * @num_q_io_pend: Number of entries in @q_io_pend
+ * @int_reset_ts: Start time in jiffies of the ongoing firmware
+ * internal device reset, 0 if none
+ * @int_reset_count: Firmware internal device resets of the target
+ * @int_reset_max: Longest internal device reset in milliseconds
+ * @int_reset_time: Time in milliseconds spent in internal resets
+ * @int_reset_work: Ends an internal reset not reported complete
+ * within MPI3MR_INT_RESET_MAX_TIMEOUT seconds
  */
 struct mpi3mr_stgt_priv_data {
 	struct scsi_target *starget;
+	unsigned long io_state;
 	u16 dev_handle;
 	u16 perst_id;
 	u32 num_luns;
@@ -495,6 +659,43 @@ struct mpi3mr_stgt_priv_data {
 	u8 dev_removedelay;
 	u8 dev_type;
 	struct mpi3mr_tgt_dev *tgt_dev;
+	struct work_struct io_block_work;
+	atomic_t *q_io_pend;
+	u16 num_q_io_pend;
+	unsigned long int_reset_ts;
+	u32 int_reset_count;
+	u32 int_reset_max;
+	u64 int_reset_time;
+	struct delayed_work int_reset_work;
+};
+
+/**
+ * mpi3mr_set_tgt_handle - Set the device handle of a target
+ * @s: SCSI target private data
+ * @handle: FW device handle
+ *
+ * Update the device handle and the matching I/O admission
+ * state bit of the target.
+ */
+static inline void mpi3mr_set_tgt_handle(struct mpi3mr_stgt_priv_data *s,
+	u16 handle)
+{
+	s->dev_handle = handle;
+	if (handle == MPI3MR_INVALID_DEV_HANDLE)
+		set_bit(MPI3MR_TGT_IO_NO_HANDLE, &s->io_state);
+	else
+		clear_bit(MPI3MR_TGT_IO_NO_HANDLE, &s->io_state);
+}
+
+/**
+ * struct mpi3mr_actuator_range - Concurrent positioning range
+ *
+ * @start_lba: First LBA of the range
+ * @num_lbas: Number of LBAs in the range
+ */
+struct mpi3mr_actuator_range {
+	u64 start_lba;
+	u64 num_lbas;
 };
 
 /**
@@ -503,11 +704,36 @@ struct mpi3mr_stgt_priv_data {
  * @tgt_priv_data: Scsi_target private data pointer
  * @lun_id: LUN ID of the device
  * @ncq_prio_enable: NCQ priority enable for SATA device
+ * @num_actuators: Number of concurrent positioning ranges
+ * @actuator_range: Concurrent positioning ranges of the LUN
+ * @io_quiesced: Request queue quiesced by the driver
+ * @lost_io_query: LUN has commands to check for lost commands
+ * @io_borrowed: I/Os issued beyond the fair share
+ * @io_throttled: I/Os deferred for exceeding the fair share
+ * @vd_degraded_policy: Degraded volume I/O policy applied
+ * @vd_saved_max_hw_sectors: Maximum hardware I/O size before degrade
+ * @vd_degraded_max_hw_sectors: Maximum hardware I/O size set on
+ * degrade, 0 when the size was left in place
+ * @vd_saved_timeout: Request timeout in jiffies before degrade
+ * @vd_degraded_timeout: Request timeout in jiffies set on degrade,
+ * 0 when a user set timeout was left in place
  */
 struct mpi3mr_sdev_priv_data {
 	struct mpi3mr_stgt_priv_data *tgt_priv_data;
 	u32 lun_id;
 	u8 ncq_prio_enable;
+	u8 io_quiesced;
+	u8 lost_io_query;
+	u8 vd_degraded_policy;
+	u8 num_actuators;
+	atomic64_t io_borrowed;
+	atomic64_t io_throttled;
+	unsigned int vd_saved_max_hw_sectors;
+	unsigned int vd_degraded_max_hw_sectors;
+	unsigned int vd_saved_timeout;
+	unsigned int vd_degraded_timeout;
+	struct mpi3mr_actuator_range
+	    actuator_range[MPI3MR_MAX_ACTUATOR_RANGES];
 };
 
 /**
@@ -568,6 +794,9 @@ struct chain_element {
  * @req_q_idx: Operational request queue index
  * @chain_idx: Chain frame index
  * @meta_chain_idx: Chain frame index of meta data SGL
+ * @host_retries: Requeues done by the driver for transient errors
+ * @seq: Issue sequence number within the operational queue, zero
+ * until the command is posted
  * @mpi3mr_scsiio_req: MPI SCSI IO request
  */
 struct scmd_priv {
@@ -578,9 +807,32 @@ struct scmd_priv {
 	u16 req_q_idx;
 	int chain_idx;
 	int meta_chain_idx;
+	u8 host_retries;
+	u32 seq;
 	u8 mpi3mr_scsiio_req[MPI3MR_ADMIN_REQ_FRAME_SZ];
 };
 
+struct mpi3mr_ioc;
+
+/**
+ * struct mpi3mr_sysif_ops - System interface register backend
+ *
+ * Replaces the MMIO accesses of the __mpi3mr_sysif_* helpers when
+ * set in the adapter instance, used by the KUnit tests to run the
+ * queue posting paths against a software register file.
+ *
+ * @readl: Read a 32 bit register
+ * @writel: Write a 32 bit register
+ * @readq: Read a 64 bit register
+ * @writeq: Write a 64 bit register
+ */
+struct mpi3mr_sysif_ops {
+	u32 (*readl)(struct mpi3mr_ioc *mrioc, u32 offset);
+	void (*writel)(struct mpi3mr_ioc *mrioc, u32 offset, u32 val);
+	u64 (*readq)(struct mpi3mr_ioc *mrioc, u32 offset);
+	void (*writeq)(struct mpi3mr_ioc *mrioc, u32 offset, u64 val);
+};
+
 /**
  * struct mpi3mr_ioc - Adapter anchor structure stored in shost
  * private data
@@ -595,6 +847,7 @@ struct scmd_priv {
  * @driver_name: Driver ASCII name
  * @sysif_regs: System interface registers virtual address
  * @sysif_regs_phys: System interface registers physical address
+ * @sysif_ops: System interface register backend for KUnit tests
  * @bars: PCI BARS
  * @dma_mask: DMA mask
  * @msix_count: Number of MSIX vectors used
@@ -678,12 +931,31 @@ struct scmd_priv {
  * @reset_mutex: Controller reset mutex
  * @reset_waitq: Controller reset  wait queue
  * @diagsave_timeout: Diagnostic information save timeout
+ * @prepare_for_reset: Firmware announced a reset, I/O is quiesced
+ * @prepare_for_reset_timeout_counter: Seconds waited for the
+ * announced reset
  * @logging_level: Controller debug logging level
  * @flush_io_count: I/O count to flush after reset
  * @current_event: Firmware event currently in process
+ * @sas_disc_ports: IO unit ports with SAS discovery in progress
+ * @pcie_enum_ports: IO unit ports with PCIe enumeration in progress
+ * @disc_timeout_counter: Seconds since the last discovery or
+ * enumeration progress
+ * @bcast_pending: SAS broadcast primitives pending processing
+ * @lost_io_work: Lost command query work
+ * @host_requeues: Commands requeued for transient errors
+ * @io_active_luns: LUNs with I/O outstanding, sampled by the
+ * watchdog
  * @driver_info: Driver, Kernel, OS information to firmware
  * @change_count: Topology change count
  * @op_reply_q_offset: Operational reply queue offset with MSIx
+ * @reset_rec: Reset record of the reset in progress
+ * @reset_rec_active: Reset record is being filled
+ * @reset_start_time: Reset start time
+ * @reset_phase_time: Completion time of the last reset phase
+ * @reset_history: Completed controller reset records
+ * @reset_history_count: Number of resets recorded since load
+ * @reset_history_lock: Reset history lock
  */
 struct mpi3mr_ioc {
 	struct list_head list;
@@ -699,6 +971,9 @@ struct mpi3mr_ioc {
 
 	volatile struct mpi3_sysif_registers __iomem *sysif_regs;
 	resource_size_t sysif_regs_phys;
+#if IS_ENABLED(CONFIG_SCSI_MPI3MR_KUNIT_TEST)
+	const struct mpi3mr_sysif_ops *sysif_ops;
+#endif
 	int bars;
 	u64 dma_mask;
 
@@ -804,13 +1079,30 @@ struct mpi3mr_ioc {
 	wait_queue_head_t reset_waitq;
 
 	u16 diagsave_timeout;
+	u8 prepare_for_reset;
+	u16 prepare_for_reset_timeout_counter;
 	int logging_level;
-	u16 flush_io_count;
+	u32 flush_io_count;
 
 	struct mpi3mr_fwevt *current_event;
+	DECLARE_BITMAP(sas_disc_ports, MPI3MR_NUM_IOU_PORTS);
+	DECLARE_BITMAP(pcie_enum_ports, MPI3MR_NUM_IOU_PORTS);
+	u16 disc_timeout_counter;
+	atomic_t bcast_pending;
+	struct work_struct lost_io_work;
+	atomic64_t host_requeues;
+	u32 io_active_luns;
 	struct mpi3_driver_info_layout driver_info;
 	u16 change_count;
 	u16 op_reply_q_offset;
+
+	struct mpi3mr_reset_record reset_rec;
+	u8 reset_rec_active;
+	ktime_t reset_start_time;
+	ktime_t reset_phase_time;
+	struct mpi3mr_reset_record reset_history[MPI3MR_RESET_HISTORY_SZ];
+	u32 reset_history_count;
+	spinlock_t reset_history_lock;
 };
 
 /**
@@ -852,6 +1144,308 @@ struct delayed_dev_rmhs_node {
 	u8 iou_rc;
 };
 
+/**
+ * mpi3mr_add_sg_single - Fill in a simple or chain SGE
+ * @paddr: SGE address
+ * @flags: SGE flags
+ * @length: Data length
+ * @dma_addr: Data DMA address
+ *
+ * Called once per data segment from the I/O submission path, so
+ * keep it inline.
+ *
+ * Return: Nothing.
+ */
+static inline void mpi3mr_add_sg_single(void *paddr, u8 flags, u32 length,
+	dma_addr_t dma_addr)
+{
+	struct mpi3_sge_common *sgel = paddr;
+
+	sgel->flags = flags;
+	sgel->length = cpu_to_le32(length);
+	sgel->address = cpu_to_le64(dma_addr);
+}
+
+/*
+ * Operational queue ring helpers. These only operate on the host
+ * side queue bookkeeping and the queue memory, they never touch the
+ * system interface registers.
+ */
+
+/**
+ * mpi3mr_check_req_qfull - Check operational request queue full
+ * @op_req_q: Operational request queue info
+ *
+ * Return: true when no free request entry is available.
+ */
+static inline bool
+mpi3mr_check_req_qfull(struct op_req_qinfo *op_req_q)
+{
+	u16 pi, ci, max_entries;
+	bool is_qfull = false;
+
+	pi = op_req_q->pi;
+	ci = READ_ONCE(op_req_q->ci);
+	max_entries = op_req_q->num_requests;
+
+	if ((ci == (pi + 1)) || ((!ci) && (pi == (max_entries - 1))))
+		is_qfull = true;
+
+	return is_qfull;
+}
+
+/**
+ * mpi3mr_get_req_entry - get request frame corresponding to
+ *	queue's producer index from operational request queue.
+ * @op_req_q: Operational request queue info
+ * @pi: operational request queue producer index
+ * @req_sz: operational request frame size
+ *
+ * Return: request frame address
+ */
+static inline u8 *
+mpi3mr_get_req_entry(struct op_req_qinfo *op_req_q, u16 pi, u16 req_sz)
+{
+	struct segments *segments = op_req_q->q_segments;
+
+	return (u8 *)segments[pi / op_req_q->segment_qd].segment +
+	    ((pi % op_req_q->segment_qd) * req_sz);
+}
+
+/**
+ * mpi3mr_get_reply_desc - get reply descriptor frame corresponding to
+ *	queue's consumer index from operational reply descriptor queue.
+ * @op_reply_q: op_reply_qinfo object
+ * @reply_ci: operational reply descriptor's queue consumer index
+ *
+ * Returns reply descriptor frame address
+ */
+static inline struct mpi3_default_reply_descriptor *
+mpi3mr_get_reply_desc(struct op_reply_qinfo *op_reply_q, u32 reply_ci)
+{
+	void *segment_base_addr;
+	struct segments *segments = op_reply_q->q_segments;
+	struct mpi3_default_reply_descriptor *reply_desc = NULL;
+
+	segment_base_addr =
+	    segments[reply_ci / op_reply_q->segment_qd].segment;
+	reply_desc = (struct mpi3_default_reply_descriptor *)segment_base_addr +
+	    (reply_ci % op_reply_q->segment_qd);
+	return reply_desc;
+}
+
+/**
+ * mpi3mr_reply_desc_valid - Check reply descriptor phase
+ * @reply_desc: Reply descriptor
+ * @exp_phase: Expected phase of the reply queue
+ *
+ * Return: true when the descriptor was posted by the firmware in
+ * the current pass over the reply queue.
+ */
+static inline bool
+mpi3mr_reply_desc_valid(struct mpi3_default_reply_descriptor *reply_desc,
+	u32 exp_phase)
+{
+	return (le16_to_cpu(reply_desc->reply_flags) &
+	    MPI3_REPLY_DESCRIPT_FLAGS_PHASE_MASK) == exp_phase;
+}
+
+/**
+ * mpi3mr_reply_ci_next - Advance a reply queue consumer index
+ * @reply_ci: Current consumer index
+ * @num_replies: Number of entries in the reply queue
+ * @exp_phase: Expected phase, toggled when the index wraps
+ *
+ * Return: consumer index of the next reply descriptor.
+ */
+static inline u32
+mpi3mr_reply_ci_next(u32 reply_ci, u32 num_replies, u32 *exp_phase)
+{
+	if (++reply_ci == num_replies) {
+		reply_ci = 0;
+		*exp_phase ^= 1;
+	}
+	return reply_ci;
+}
+
+/**
+ * mpi3mr_reply_q_posted_ahead - Check a reply slot past the CI
+ * @op_reply_q: Operational reply queue info
+ * @reply_ci: Host consumer index
+ * @exp_phase: Expected phase at the consumer index
+ * @ahead: Slots past the consumer index, less than the queue depth
+ *
+ * The firmware posts reply descriptors in queue order, so when the
+ * descriptor @ahead slots past the consumer index carries the phase
+ * expected for it, at least @ahead + 1 descriptors are posted and
+ * not yet consumed.
+ *
+ * Return: true when the descriptor is posted.
+ */
+static inline bool
+mpi3mr_reply_q_posted_ahead(struct op_reply_qinfo *op_reply_q,
+	u32 reply_ci, u32 exp_phase, u32 ahead)
+{
+	u32 idx = reply_ci + ahead;
+
+	if (idx >= op_reply_q->num_replies) {
+		idx -= op_reply_q->num_replies;
+		exp_phase ^= 1;
+	}
+	return mpi3mr_reply_desc_valid(mpi3mr_get_reply_desc(op_reply_q, idx),
+	    exp_phase);
+}
+
+/*
+ * System interface register accessors. Every host access to the
+ * system interface registers goes through the __mpi3mr_sysif_*
+ * helpers below, the register is named by its member in
+ * struct mpi3_sysif_registers. With the KUnit tests enabled the
+ * accesses are redirected to mrioc->sysif_ops when it is set.
+ */
+#define MPI3MR_SYSIF_REG(reg)	offsetof(struct mpi3_sysif_registers, reg)
+
+#define mpi3mr_sysif_readl(mrioc, reg)	\
+	__mpi3mr_sysif_readl(mrioc, MPI3MR_SYSIF_REG(reg))
+#define mpi3mr_sysif_writel(mrioc, reg, val)	\
+	__mpi3mr_sysif_writel(mrioc, MPI3MR_SYSIF_REG(reg), val)
+#define mpi3mr_sysif_readq(mrioc, reg)	\
+	__mpi3mr_sysif_readq(mrioc, MPI3MR_SYSIF_REG(reg))
+#define mpi3mr_sysif_writeq(mrioc, reg, val)	\
+	__mpi3mr_sysif_writeq(mrioc, MPI3MR_SYSIF_REG(reg), val)
+
+/**
+ * __mpi3mr_sysif_readl - Read a 32 bit system interface register
+ * @mrioc: Adapter instance reference
+ * @offset: Register offset in the system interface
+ *
+ * Return: Register value.
+ */
+static inline u32
+__mpi3mr_sysif_readl(struct mpi3mr_ioc *mrioc, u32 offset)
+{
+#if IS_ENABLED(CONFIG_SCSI_MPI3MR_KUNIT_TEST)
+	if (unlikely(mrioc->sysif_ops))
+		return mrioc->sysif_ops->readl(mrioc, offset);
+#endif
+	return readl((u8 __iomem *)mrioc->sysif_regs + offset);
+}
+
+/**
+ * __mpi3mr_sysif_writel - Write a 32 bit system interface register
+ * @mrioc: Adapter instance reference
+ * @offset: Register offset in the system interface
+ * @val: Value to write
+ *
+ * Return: Nothing.
+ */
+static inline void
+__mpi3mr_sysif_writel(struct mpi3mr_ioc *mrioc, u32 offset, u32 val)
+{
+#if IS_ENABLED(CONFIG_SCSI_MPI3MR_KUNIT_TEST)
+	if (unlikely(mrioc->sysif_ops)) {
+		mrioc->sysif_ops->writel(mrioc, offset, val);
+		return;
+	}
+#endif
+	writel(val, (u8 __iomem *)mrioc->sysif_regs + offset);
+}
+
+/**
+ * __mpi3mr_sysif_readq - Read a 64 bit system interface register
+ * @mrioc: Adapter instance reference
+ * @offset: Register offset in the system interface
+ *
+ * The register is read as two 32 bit halves, low half first.
+ *
+ * Return: Register value.
+ */
+static inline u64
+__mpi3mr_sysif_readq(struct mpi3mr_ioc *mrioc, u32 offset)
+{
+#if IS_ENABLED(CONFIG_SCSI_MPI3MR_KUNIT_TEST)
+	if (unlikely(mrioc->sysif_ops))
+		return mrioc->sysif_ops->readq(mrioc, offset);
+#endif
+	return lo_hi_readq((u8 __iomem *)mrioc->sysif_regs + offset);
+}
+
+/**
+ * __mpi3mr_sysif_writeq - Write a 64 bit system interface register
+ * @mrioc: Adapter instance reference
+ * @offset: Register offset in the system interface
+ * @val: Value to write
+ *
+ * A single 64 bit write is used when the platform has one,
+ * otherwise the low half is written first.
+ *
+ * Return: Nothing.
+ */
+static inline void
+__mpi3mr_sysif_writeq(struct mpi3mr_ioc *mrioc, u32 offset, u64 val)
+{
+	void __iomem *addr = (u8 __iomem *)mrioc->sysif_regs + offset;
+
+#if IS_ENABLED(CONFIG_SCSI_MPI3MR_KUNIT_TEST)
+	if (unlikely(mrioc->sysif_ops)) {
+		mrioc->sysif_ops->writeq(mrioc, offset, val);
+		return;
+	}
+#endif
+#if defined(CONFIG_64BIT)
+	writeq(val, addr);
+#else
+	lo_hi_writeq(val, addr);
+#endif
+}
+
+/**
+ * mpi3mr_op_req_q_doorbell - Publish operational request queue PI
+ * @mrioc: Adapter instance reference
+ * @qidx: Operational queue index
+ * @pi: New producer index
+ *
+ * All operational request queue producer index updates go through
+ * this accessor.
+ *
+ * Return: Nothing.
+ */
+static inline void
+mpi3mr_op_req_q_doorbell(struct mpi3mr_ioc *mrioc, u16 qidx, u16 pi)
+{
+	mpi3mr_sysif_writel(mrioc, oper_queue_indexes[qidx].producer_index, pi);
+}
+
+/**
+ * mpi3mr_op_reply_q_doorbell - Publish operational reply queue CI
+ * @mrioc: Adapter instance reference
+ * @qidx: Operational queue index
+ * @ci: New consumer index
+ *
+ * All operational reply queue consumer index updates go through
+ * this accessor.
+ *
+ * Return: Nothing.
+ */
+static inline void
+mpi3mr_op_reply_q_doorbell(struct mpi3mr_ioc *mrioc, u16 qidx, u32 ci)
+{
+	mpi3mr_sysif_writel(mrioc, oper_queue_indexes[qidx].consumer_index, ci);
+}
+
+/**
+ * mpi3mr_discovery_pending - Check for discovery in progress
+ * @mrioc: Adapter instance reference
+ *
+ * Return: true when SAS discovery or PCIe enumeration is in
+ * progress on any IO unit port.
+ */
+static inline bool mpi3mr_discovery_pending(struct mpi3mr_ioc *mrioc)
+{
+	return !bitmap_empty(mrioc->sas_disc_ports, MPI3MR_NUM_IOU_PORTS) ||
+	    !bitmap_empty(mrioc->pcie_enum_ports, MPI3MR_NUM_IOU_PORTS);
+}
+
 int mpi3mr_setup_resources(struct mpi3mr_ioc *mrioc);
 void mpi3mr_cleanup_resources(struct mpi3mr_ioc *mrioc);
 int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init);
@@ -860,9 +1454,7 @@ int mpi3mr_issue_port_enable(struct mpi3mr_ioc *mrioc, u8 async);
 int mpi3mr_admin_request_post(struct mpi3mr_ioc *mrioc, void *admin_req,
 u16 admin_req_sz, u8 ignore_reset);
 int mpi3mr_op_request_post(struct mpi3mr_ioc *mrioc,
-			   struct op_req_qinfo *opreqq, u8 *req);
-void mpi3mr_add_sg_single(void *paddr, u8 flags, u32 length,
-			  dma_addr_t dma_addr);
+			   struct op_req_qinfo *opreqq, u8 *req, u32 *seq);
 void mpi3mr_build_zero_len_sge(void *paddr);
 void *mpi3mr_get_sensebuf_virt_addr(struct mpi3mr_ioc *mrioc,
 				     dma_addr_t phys_addr);
@@ -875,7 +1467,7 @@ void mpi3mr_os_handle_events(struct mpi3mr_ioc *mrioc,
 			     struct mpi3_event_notification_reply *event_reply);
 void mpi3mr_process_op_reply_desc(struct mpi3mr_ioc *mrioc,
 				  struct mpi3_default_reply_descriptor *reply_desc,
-				  u64 *reply_dma, u16 qidx);
+				  u64 *reply_dma, u64 *sense_dma, u16 qidx);
 void mpi3mr_start_watchdog(struct mpi3mr_ioc *mrioc);
 void mpi3mr_stop_watchdog(struct mpi3mr_ioc *mrioc);
 
@@ -885,6 +1477,7 @@ int mpi3mr_diagfault_reset_handler(struct mpi3mr_ioc *mrioc,
 				   u32 reset_reason);
 void mpi3mr_ioc_disable_intr(struct mpi3mr_ioc *mrioc);
 void mpi3mr_ioc_enable_intr(struct mpi3mr_ioc *mrioc);
+void mpi3mr_sync_op_reply_q(struct mpi3mr_ioc *mrioc, u16 qidx);
 
 enum mpi3mr_iocstate mpi3mr_get_iocstate(struct mpi3mr_ioc *mrioc);
 int mpi3mr_send_event_ack(struct mpi3mr_ioc *mrioc, u8 event,
@@ -895,6 +1488,21 @@ void mpi3mr_cleanup_fwevt_list(struct mpi3mr_ioc *mrioc);
 void mpi3mr_flush_host_io(struct mpi3mr_ioc *mrioc);
 void mpi3mr_invalidate_devhandles(struct mpi3mr_ioc *mrioc);
 void mpi3mr_rfresh_tgtdevs(struct mpi3mr_ioc *mrioc);
+void mpi3mr_tgtdev_refresh_evt(struct mpi3mr_ioc *mrioc);
 void mpi3mr_flush_delayed_rmhs_list(struct mpi3mr_ioc *mrioc);
+void mpi3mr_block_host_io(struct mpi3mr_ioc *mrioc);
+void mpi3mr_unblock_host_io(struct mpi3mr_ioc *mrioc);
+void mpi3mr_update_host_io_state(struct mpi3mr_ioc *mrioc);
+void mpi3mr_prepare_for_reset_end(struct mpi3mr_ioc *mrioc);
+void mpi3mr_discovery_timeout(struct mpi3mr_ioc *mrioc);
+void mpi3mr_count_active_luns(struct mpi3mr_ioc *mrioc);
+void mpi3mr_block_tgt_io(struct mpi3mr_ioc *mrioc,
+			 struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data);
+void mpi3mr_unblock_tgt_io(struct mpi3mr_ioc *mrioc,
+			   struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data);
+void mpi3mr_release_tgt_io(struct mpi3mr_ioc *mrioc,
+			   struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data);
+ssize_t mpi3mr_print_reset_history(struct mpi3mr_ioc *mrioc, char *buf,
+				   size_t size);
 
 #endif /*MPI3MR_H_INCLUDED*/
@@ -8,40 +8,8 @@
  */
 
 #include "mpi3mr.h"
-#include <linux/io-64-nonatomic-lo-hi.h>
 extern int prot_mask;
 
-#if defined(writeq) && defined(CONFIG_64BIT)
-static inline void mpi3mr_writeq(__u64 b, volatile void __iomem *addr)
-{
-	writeq(b, addr);
-}
-#else
-static inline void mpi3mr_writeq(__u64 b, volatile void __iomem *addr)
-{
-	__u64 data_out = b;
-
-	writel((u32)(data_out), addr);
-	writel((u32)(data_out >> 32), (addr + 4));
-}
-#endif
-
-static inline bool
-mpi3mr_check_req_qfull(struct op_req_qinfo *op_req_q)
-{
-	u16 pi, ci, max_entries;
-	bool is_qfull = false;
-
-	pi = op_req_q->pi;
-	ci = READ_ONCE(op_req_q->ci);
-	max_entries = op_req_q->num_requests;
-
-	if ((ci == (pi + 1)) || ((!ci) && (pi == (max_entries - 1))))
-		is_qfull = true;
-
-	return is_qfull;
-}
-
 static void mpi3mr_sync_irqs(struct mpi3mr_ioc *mrioc)
 {
 	u16 i, max_vectors;
@@ -82,16 +50,6 @@ static void mpi3mr_cleanup_isr(struct mpi3mr_ioc *mrioc)
 	pci_free_irq_vectors(mrioc->pdev);
 }
 
-void mpi3mr_add_sg_single(void *paddr, u8 flags, u32 length,
-	dma_addr_t dma_addr)
-{
-	struct mpi3_sge_common *sgel = paddr;
-
-	sgel->flags = flags;
-	sgel->length = cpu_to_le32(length);
-	sgel->address = cpu_to_le64(dma_addr);
-}
-
 void mpi3mr_build_zero_len_sge(void *paddr)
 {
 	u8 sgl_flags = MPI3MR_SGEFLAGS_SYSTEM_SIMPLE_END_OF_LIST;
@@ -133,8 +91,8 @@ static void mpi3mr_repost_reply_buf(struct mpi3mr_ioc *mrioc,
 	    (mrioc->reply_free_qsz - 1)) ? 0 :
 	    (mrioc->reply_free_queue_host_index + 1));
 	mrioc->reply_free_q[old_idx] = cpu_to_le64(reply_dma);
-	writel(mrioc->reply_free_queue_host_index,
-	    &mrioc->sysif_regs->reply_free_host_index);
+	mpi3mr_sysif_writel(mrioc, reply_free_host_index,
+	    mrioc->reply_free_queue_host_index);
 	spin_unlock(&mrioc->reply_free_queue_lock);
 }
 
@@ -149,11 +107,41 @@ void mpi3mr_repost_sense_buf(struct mpi3mr_ioc *mrioc,
 	    (mrioc->sense_buf_q_sz - 1)) ? 0 :
 	    (mrioc->sbq_host_index + 1));
 	mrioc->sense_buf_q[old_idx] = cpu_to_le64(sense_buf_dma);
-	writel(mrioc->sbq_host_index,
-	    &mrioc->sysif_regs->sense_buffer_free_host_index);
+	mpi3mr_sysif_writel(mrioc, sense_buffer_free_host_index,
+	    mrioc->sbq_host_index);
 	spin_unlock(&mrioc->sbq_lock);
 }
 
+/**
+ * mpi3mr_repost_reply_bufs - Return reply frames to the firmware
+ * @mrioc: Adapter instance reference
+ * @reply_dma: DMA addresses of the reply frames
+ * @count: Number of reply frames
+ *
+ * Post a batch of processed reply frames to the reply free queue
+ * with a single lock acquisition and host index update.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_repost_reply_bufs(struct mpi3mr_ioc *mrioc,
+	u64 *reply_dma, u32 count)
+{
+	u32 i;
+
+	spin_lock(&mrioc->reply_free_queue_lock);
+	for (i = 0; i < count; i++) {
+		mrioc->reply_free_q[mrioc->reply_free_queue_host_index] =
+		    cpu_to_le64(reply_dma[i]);
+		mrioc->reply_free_queue_host_index = (
+		    (mrioc->reply_free_queue_host_index ==
+		    (mrioc->reply_free_qsz - 1)) ? 0 :
+		    (mrioc->reply_free_queue_host_index + 1));
+	}
+	mpi3mr_sysif_writel(mrioc, reply_free_host_index,
+	    mrioc->reply_free_queue_host_index);
+	spin_unlock(&mrioc->reply_free_queue_lock);
+}
+
 static void mpi3mr_print_event_data(struct mpi3mr_ioc *mrioc,
 	struct mpi3_event_notification_reply *event_reply)
 {
@@ -260,6 +248,9 @@ static void mpi3mr_print_event_data(struct mpi3mr_ioc *mrioc,
 	case MPI3_EVENT_PREPARE_FOR_RESET:
 		desc = "Prepare For Reset";
 		break;
+	case MPI3_EVENT_COMP_IMAGE_ACT_START:
+		desc = "Component Image Activation Start";
+		break;
 	}
 
 	if (!desc)
@@ -396,8 +387,7 @@ static int mpi3mr_process_admin_reply_q(struct mpi3mr_ioc *mrioc)
 	reply_desc = (struct mpi3_default_reply_descriptor *)mrioc->admin_reply_base +
 	    admin_reply_ci;
 
-	if ((le16_to_cpu(reply_desc->reply_flags) &
-	    MPI3_REPLY_DESCRIPT_FLAGS_PHASE_MASK) != exp_phase)
+	if (!mpi3mr_reply_desc_valid(reply_desc, exp_phase))
 		return 0;
 
 	do {
@@ -406,47 +396,22 @@ static int mpi3mr_process_admin_reply_q(struct mpi3mr_ioc *mrioc)
 		if (reply_dma)
 			mpi3mr_repost_reply_buf(mrioc, reply_dma);
 		num_admin_replies++;
-		if (++admin_reply_ci == mrioc->num_admin_replies) {
-			admin_reply_ci = 0;
-			exp_phase ^= 1;
-		}
+		admin_reply_ci = mpi3mr_reply_ci_next(admin_reply_ci,
+		    mrioc->num_admin_replies, &exp_phase);
 		reply_desc =
 		    (struct mpi3_default_reply_descriptor *)mrioc->admin_reply_base +
 		    admin_reply_ci;
-		if ((le16_to_cpu(reply_desc->reply_flags) &
-		    MPI3_REPLY_DESCRIPT_FLAGS_PHASE_MASK) != exp_phase)
+		if (!mpi3mr_reply_desc_valid(reply_desc, exp_phase))
 			break;
 	} while (1);
 
-	writel(admin_reply_ci, &mrioc->sysif_regs->admin_reply_queue_ci);
+	mpi3mr_sysif_writel(mrioc, admin_reply_queue_ci, admin_reply_ci);
 	mrioc->admin_reply_ci = admin_reply_ci;
 	mrioc->admin_reply_ephase = exp_phase;
 
 	return num_admin_replies;
 }
 
-/**
- * mpi3mr_get_reply_desc - get reply descriptor frame corresponding to
- *	queue's consumer index from operational reply descriptor queue.
- * @op_reply_q: op_reply_qinfo object
- * @reply_ci: operational reply descriptor's queue consumer index
- *
- * Returns reply descriptor frame address
- */
-static inline struct mpi3_default_reply_descriptor *
-mpi3mr_get_reply_desc(struct op_reply_qinfo *op_reply_q, u32 reply_ci)
-{
-	void *segment_base_addr;
-	struct segments *segments = op_reply_q->q_segments;
-	struct mpi3_default_reply_descriptor *reply_desc = NULL;
-
-	segment_base_addr =
-	    segments[reply_ci / op_reply_q->segment_qd].segment;
-	reply_desc = (struct mpi3_default_reply_descriptor *)segment_base_addr +
-	    (reply_ci % op_reply_q->segment_qd);
-	return reply_desc;
-}
-
 static int mpi3mr_process_op_reply_q(struct mpi3mr_ioc *mrioc,
 	struct mpi3mr_intr_info *intr_info)
 {
@@ -455,7 +420,11 @@ static int mpi3mr_process_op_reply_q(struct mpi3mr_ioc *mrioc,
 	u32 exp_phase;
 	u32 reply_ci;
 	u32 num_op_reply = 0;
-	u64 reply_dma = 0;
+	u64 reply_dma = 0, sense_dma = 0;
+	u64 reply_dmas[MPI3MR_REPOST_BATCH];
+	u32 num_reply_dmas = 0;
+	int num_unpublished = 0, ahead;
+	bool early_publish = false;
 	struct mpi3_default_reply_descriptor *reply_desc;
 	u16 req_q_idx = 0, reply_qidx;
 
@@ -468,8 +437,7 @@ static int mpi3mr_process_op_reply_q(struct mpi3mr_ioc *mrioc,
 	reply_ci = op_reply_q->ci;
 
 	reply_desc = mpi3mr_get_reply_desc(op_reply_q, reply_ci);
-	if ((le16_to_cpu(reply_desc->reply_flags) &
-	    MPI3_REPLY_DESCRIPT_FLAGS_PHASE_MASK) != exp_phase) {
+	if (!mpi3mr_reply_desc_valid(reply_desc, exp_phase)) {
 		atomic_dec(&op_reply_q->in_use);
 		return 0;
 	}
@@ -480,21 +448,56 @@ static int mpi3mr_process_op_reply_q(struct mpi3mr_ioc *mrioc,
 
 		WRITE_ONCE(op_req_q->ci, le16_to_cpu(reply_desc->request_queue_ci));
 		mpi3mr_process_op_reply_desc(mrioc, reply_desc, &reply_dma,
-		    reply_qidx);
+		    &sense_dma, reply_qidx);
 		atomic_dec(&op_reply_q->pend_ios);
-		if (reply_dma)
-			mpi3mr_repost_reply_buf(mrioc, reply_dma);
+
+		/*
+		 * Address replies are returned in batches to take the free
+		 * queue lock once per batch rather than once per reply.
+		 * Sense buffers are far fewer than the commands that can
+		 * complete with a check condition in one drain, hold none
+		 * back from the firmware.
+		 */
+		if (reply_dma) {
+			reply_dmas[num_reply_dmas++] = reply_dma;
+			if (num_reply_dmas == MPI3MR_REPOST_BATCH) {
+				mpi3mr_repost_reply_bufs(mrioc, reply_dmas,
+				    num_reply_dmas);
+				num_reply_dmas = 0;
+			}
+		}
+		if (sense_dma)
+			mpi3mr_repost_sense_buf(mrioc, sense_dma);
 		num_op_reply++;
+		num_unpublished++;
+
+		reply_ci = mpi3mr_reply_ci_next(reply_ci,
+		    op_reply_q->num_replies, &exp_phase);
 
-		if (++reply_ci == op_reply_q->num_replies) {
-			reply_ci = 0;
-			exp_phase ^= 1;
+		/*
+		 * Return the processed reply slots to the firmware while a
+		 * long completion burst is being drained. The firmware sees
+		 * the unpublished descriptors and the ones it posted past
+		 * the consumer index as used. Every WMARK_BATCH descriptors
+		 * check whether the descriptor bringing that occupancy to
+		 * the fill watermark is already posted, and publish if so.
+		 */
+		ahead = (int)op_reply_q->fill_wmark - num_unpublished;
+		if (num_unpublished == MPI3MR_OP_REP_Q_CI_BATCH ||
+		    (!(num_unpublished % MPI3MR_OP_REP_Q_CI_WMARK_BATCH) &&
+		    (ahead <= 0 || mpi3mr_reply_q_posted_ahead(op_reply_q,
+		    reply_ci, exp_phase, ahead - 1)))) {
+			if (num_unpublished < MPI3MR_OP_REP_Q_CI_BATCH)
+				op_reply_q->wmark_updates++;
+			mpi3mr_op_reply_q_doorbell(mrioc, reply_qidx, reply_ci);
+			op_reply_q->ci_updates++;
+			num_unpublished = 0;
+			early_publish = true;
 		}
 
 		reply_desc = mpi3mr_get_reply_desc(op_reply_q, reply_ci);
 
-		if ((le16_to_cpu(reply_desc->reply_flags) &
-		    MPI3_REPLY_DESCRIPT_FLAGS_PHASE_MASK) != exp_phase)
+		if (!mpi3mr_reply_desc_valid(reply_desc, exp_phase))
 			break;
 		/*
 		 * Exit completion loop to avoid CPU lockup
@@ -507,11 +510,21 @@ static int mpi3mr_process_op_reply_q(struct mpi3mr_ioc *mrioc,
 
 	} while (1);
 
-	writel(reply_ci,
-	    &mrioc->sysif_regs->oper_queue_indexes[reply_qidx].consumer_index);
+	if (num_reply_dmas)
+		mpi3mr_repost_reply_bufs(mrioc, reply_dmas, num_reply_dmas);
+
+	if (num_unpublished) {
+		mpi3mr_op_reply_q_doorbell(mrioc, reply_qidx, reply_ci);
+		op_reply_q->ci_updates++;
+	}
 	op_reply_q->ci = reply_ci;
 	op_reply_q->ephase = exp_phase;
 
+	if (num_op_reply > op_reply_q->max_drain)
+		op_reply_q->max_drain = num_op_reply;
+	if (early_publish)
+		op_reply_q->deep_drains++;
+
 	atomic_dec(&op_reply_q->in_use);
 	return num_op_reply;
 }
@@ -620,6 +633,36 @@ static irqreturn_t mpi3mr_isr_poll(int irq, void *privdata)
 	return IRQ_HANDLED;
 }
 
+/**
+ * mpi3mr_sync_op_reply_q - Flush an operational reply queue
+ * @mrioc: Adapter instance reference
+ * @qidx: Operational reply queue index
+ *
+ * Wait for the ISR of the reply queue's vector to complete and
+ * process any reply left in the queue, so that every reply
+ * posted before this call is completed on return.  When another
+ * context, such as the IRQ poll thread or a submitter finding
+ * its request queue full, is processing the queue, wait for it
+ * to finish instead.  Interrupts of the vector and of the other
+ * vectors stay enabled.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_sync_op_reply_q(struct mpi3mr_ioc *mrioc, u16 qidx)
+{
+	u16 midx = REPLY_QUEUE_IDX_TO_MSIX_IDX(qidx, mrioc->op_reply_q_offset);
+	struct op_reply_qinfo *op_reply_q = mrioc->op_reply_qinfo + qidx;
+
+	if (qidx >= mrioc->num_op_reply_q)
+		return;
+
+	synchronize_irq(pci_irq_vector(mrioc->pdev, midx));
+	if (mpi3mr_process_op_reply_q(mrioc, mrioc->intr_info + midx))
+		return;
+	while (atomic_read(&op_reply_q->in_use))
+		cpu_relax();
+}
+
 /**
  * mpi3mr_request_irq - Request IRQ and register ISR
  * @mrioc: Adapter instance reference
@@ -850,6 +893,151 @@ static const char *mpi3mr_reset_type_name(u16 reset_type)
 	return name;
 }
 
+/* Reset phase names used for reset history */
+static const char * const mpi3mr_reset_phase_names[] = {
+	[MPI3MR_RESET_PHASE_IO_BLOCK] = "io_block",
+	[MPI3MR_RESET_PHASE_FW_RESET] = "fw_reset",
+	[MPI3MR_RESET_PHASE_READY] = "ready",
+	[MPI3MR_RESET_PHASE_QUEUE_CREATE] = "queue_create",
+	[MPI3MR_RESET_PHASE_PORT_ENABLE] = "port_enable",
+	[MPI3MR_RESET_PHASE_FW_SETTLE] = "fw_settle",
+	[MPI3MR_RESET_PHASE_IO_RESUME] = "io_resume",
+};
+
+/**
+ * mpi3mr_reset_history_start - Start a reset history record
+ * @mrioc: Adapter instance reference
+ * @reset_reason: Reset reason code
+ * @reset_type: Reset type
+ *
+ * Initialize the in-progress reset record and take the start
+ * timestamp used for the per phase timing. Must be called with
+ * the reset serialized against other resets.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_reset_history_start(struct mpi3mr_ioc *mrioc,
+	u32 reset_reason, u16 reset_type)
+{
+	struct mpi3mr_reset_record *rec = &mrioc->reset_rec;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->reset_reason = reset_reason;
+	rec->reset_type = reset_type;
+	rec->start_time = ktime_get_real_seconds();
+	mrioc->reset_start_time = ktime_get();
+	mrioc->reset_phase_time = mrioc->reset_start_time;
+	mrioc->reset_rec_active = 1;
+}
+
+/**
+ * mpi3mr_reset_phase_done - Account time for a reset phase
+ * @mrioc: Adapter instance reference
+ * @phase: Reset phase which just completed
+ *
+ * Add the time elapsed since the previous phase completion to
+ * the given phase of the in-progress reset record. This is a
+ * nop when no reset record is active, e.g. during driver load
+ * or resume.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_reset_phase_done(struct mpi3mr_ioc *mrioc,
+	enum mpi3mr_reset_phase phase)
+{
+	ktime_t now;
+
+	if (!mrioc->reset_rec_active)
+		return;
+
+	now = ktime_get();
+	mrioc->reset_rec.phase_ms[phase] +=
+	    ktime_ms_delta(now, mrioc->reset_phase_time);
+	mrioc->reset_phase_time = now;
+}
+
+/**
+ * mpi3mr_reset_history_end - Complete a reset history record
+ * @mrioc: Adapter instance reference
+ * @success: Reset outcome
+ *
+ * Finalize the in-progress reset record and add it to the
+ * bounded reset history, overwriting the oldest record once
+ * the history is full.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_reset_history_end(struct mpi3mr_ioc *mrioc, u8 success)
+{
+	struct mpi3mr_reset_record *rec = &mrioc->reset_rec;
+	unsigned long flags;
+
+	if (!mrioc->reset_rec_active)
+		return;
+
+	rec->success = success;
+	rec->total_ms = ktime_ms_delta(ktime_get(), mrioc->reset_start_time);
+	mrioc->reset_rec_active = 0;
+
+	spin_lock_irqsave(&mrioc->reset_history_lock, flags);
+	rec->seq = mrioc->reset_history_count;
+	mrioc->reset_history[mrioc->reset_history_count %
+	    MPI3MR_RESET_HISTORY_SZ] = *rec;
+	mrioc->reset_history_count++;
+	spin_unlock_irqrestore(&mrioc->reset_history_lock, flags);
+
+	ioc_info(mrioc, "%s reset (%s) %s in %u ms, flushed %u I/Os\n",
+	    mpi3mr_reset_type_name(rec->reset_type),
+	    mpi3mr_reset_rc_name(rec->reset_reason),
+	    success ? "completed" : "failed", rec->total_ms,
+	    rec->flush_io_count);
+}
+
+/**
+ * mpi3mr_print_reset_history - Format the reset history
+ * @mrioc: Adapter instance reference
+ * @buf: Output buffer
+ * @size: Output buffer size
+ *
+ * Format the retained controller reset records, oldest first,
+ * one record per line with the per phase timing in
+ * milliseconds.
+ *
+ * Return: Number of bytes written to the buffer.
+ */
+ssize_t mpi3mr_print_reset_history(struct mpi3mr_ioc *mrioc, char *buf,
+	size_t size)
+{
+	struct mpi3mr_reset_record *rec;
+	unsigned long flags;
+	ssize_t len = 0;
+	u32 i, first;
+	int phase;
+
+	spin_lock_irqsave(&mrioc->reset_history_lock, flags);
+	first = 0;
+	if (mrioc->reset_history_count > MPI3MR_RESET_HISTORY_SZ)
+		first = mrioc->reset_history_count - MPI3MR_RESET_HISTORY_SZ;
+
+	for (i = first; i < mrioc->reset_history_count; i++) {
+		rec = &mrioc->reset_history[i % MPI3MR_RESET_HISTORY_SZ];
+		len += scnprintf(buf + len, size - len,
+		    "seq=%u time=%lld type=%s reason=%u result=%s flushed=%u total=%u",
+		    rec->seq, rec->start_time,
+		    mpi3mr_reset_type_name(rec->reset_type),
+		    rec->reset_reason, rec->success ? "success" : "failed",
+		    rec->flush_io_count, rec->total_ms);
+		for (phase = 0; phase < MPI3MR_RESET_PHASE_MAX; phase++)
+			len += scnprintf(buf + len, size - len, " %s=%u",
+			    mpi3mr_reset_phase_names[phase],
+			    rec->phase_ms[phase]);
+		len += scnprintf(buf + len, size - len, "\n");
+	}
+	spin_unlock_irqrestore(&mrioc->reset_history_lock, flags);
+
+	return len;
+}
+
 /**
  * mpi3mr_print_fault_info - Display fault information
  * @mrioc: Adapter instance reference
@@ -863,13 +1051,13 @@ static void mpi3mr_print_fault_info(struct mpi3mr_ioc *mrioc)
 {
 	u32 ioc_status, code, code1, code2, code3;
 
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 
 	if (ioc_status & MPI3_SYSIF_IOC_STATUS_FAULT) {
-		code = readl(&mrioc->sysif_regs->fault);
-		code1 = readl(&mrioc->sysif_regs->fault_info[0]);
-		code2 = readl(&mrioc->sysif_regs->fault_info[1]);
-		code3 = readl(&mrioc->sysif_regs->fault_info[2]);
+		code = mpi3mr_sysif_readl(mrioc, fault);
+		code1 = mpi3mr_sysif_readl(mrioc, fault_info[0]);
+		code2 = mpi3mr_sysif_readl(mrioc, fault_info[1]);
+		code3 = mpi3mr_sysif_readl(mrioc, fault_info[2]);
 
 		ioc_info(mrioc,
 		    "fault code(0x%08X): Additional code: (0x%08X:0x%08X:0x%08X)\n",
@@ -891,8 +1079,8 @@ enum mpi3mr_iocstate mpi3mr_get_iocstate(struct mpi3mr_ioc *mrioc)
 	u32 ioc_status, ioc_config;
 	u8 ready, enabled;
 
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 
 	if (mrioc->unrecoverable)
 		return MRIOC_STATE_UNRECOVERABLE;
@@ -925,9 +1113,9 @@ static inline void mpi3mr_clear_reset_history(struct mpi3mr_ioc *mrioc)
 {
 	u32 ioc_status;
 
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 	if (ioc_status & MPI3_SYSIF_IOC_STATUS_RESET_HISTORY)
-		writel(ioc_status, &mrioc->sysif_regs->ioc_status);
+		mpi3mr_sysif_writel(mrioc, ioc_status, ioc_status);
 }
 
 /**
@@ -952,18 +1140,18 @@ static int mpi3mr_issue_and_process_mur(struct mpi3mr_ioc *mrioc,
 		return retval;
 	}
 	mpi3mr_clear_reset_history(mrioc);
-	writel(reset_reason, &mrioc->sysif_regs->scratchpad[0]);
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	mpi3mr_sysif_writel(mrioc, scratchpad[0], reset_reason);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 	ioc_config &= ~MPI3_SYSIF_IOC_CONFIG_ENABLE_IOC;
-	writel(ioc_config, &mrioc->sysif_regs->ioc_configuration);
+	mpi3mr_sysif_writel(mrioc, ioc_configuration, ioc_config);
 
 	timeout = mrioc->ready_timeout * 10;
 	do {
-		ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+		ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 		if ((ioc_status & MPI3_SYSIF_IOC_STATUS_RESET_HISTORY)) {
 			mpi3mr_clear_reset_history(mrioc);
 			ioc_config =
-			    readl(&mrioc->sysif_regs->ioc_configuration);
+			    mpi3mr_sysif_readl(mrioc, ioc_configuration);
 			if (!((ioc_status & MPI3_SYSIF_IOC_STATUS_READY) ||
 			      (ioc_status & MPI3_SYSIF_IOC_STATUS_FAULT) ||
 			    (ioc_config & MPI3_SYSIF_IOC_CONFIG_ENABLE_IOC))) {
@@ -974,8 +1162,8 @@ static int mpi3mr_issue_and_process_mur(struct mpi3mr_ioc *mrioc,
 		msleep(100);
 	} while (--timeout);
 
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 
 	ioc_info(mrioc, "Base IOC Sts/Config after %s MUR is (0x%x)/(0x%x)\n",
 	    (!retval) ? "successful" : "failed", ioc_status, ioc_config);
@@ -996,9 +1184,9 @@ static int mpi3mr_bring_ioc_ready(struct mpi3mr_ioc *mrioc)
 	u32 ioc_config, timeout;
 	enum mpi3mr_iocstate current_state;
 
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 	ioc_config |= MPI3_SYSIF_IOC_CONFIG_ENABLE_IOC;
-	writel(ioc_config, &mrioc->sysif_regs->ioc_configuration);
+	mpi3mr_sysif_writel(mrioc, ioc_configuration, ioc_config);
 
 	timeout = mrioc->ready_timeout * 10;
 	do {
@@ -1047,7 +1235,7 @@ static inline bool mpi3mr_diagfault_success(struct mpi3mr_ioc *mrioc,
 
 	if (!(ioc_status & MPI3_SYSIF_IOC_STATUS_FAULT))
 		return false;
-	fault = readl(&mrioc->sysif_regs->fault) & MPI3_SYSIF_FAULT_CODE_MASK;
+	fault = mpi3mr_sysif_readl(mrioc, fault) & MPI3_SYSIF_FAULT_CODE_MASK;
 	if (fault == MPI3_SYSIF_FAULT_CODE_DIAG_FAULT_RESET)
 		return true;
 	return false;
@@ -1066,9 +1254,9 @@ static inline void mpi3mr_set_diagsave(struct mpi3mr_ioc *mrioc)
 {
 	u32 ioc_config;
 
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 	ioc_config |= MPI3_SYSIF_IOC_CONFIG_DIAG_SAVE;
-	writel(ioc_config, &mrioc->sysif_regs->ioc_configuration);
+	mpi3mr_sysif_writel(mrioc, ioc_configuration, ioc_config);
 }
 
 /**
@@ -1105,47 +1293,47 @@ retry_reset:
 		    "Write magic sequence to unlock host diag register (retry=%d)\n",
 		    ++unlock_retry_count);
 		if (unlock_retry_count >= MPI3MR_HOSTDIAG_UNLOCK_RETRY_COUNT) {
-			writel(reset_reason, &mrioc->sysif_regs->scratchpad[0]);
+			mpi3mr_sysif_writel(mrioc, scratchpad[0], reset_reason);
 			mrioc->unrecoverable = 1;
 			goto out;
 		}
 
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_FLUSH,
-		    &mrioc->sysif_regs->write_sequence);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_1ST,
-		    &mrioc->sysif_regs->write_sequence);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_2ND,
-		    &mrioc->sysif_regs->write_sequence);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_3RD,
-		    &mrioc->sysif_regs->write_sequence);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_4TH,
-		    &mrioc->sysif_regs->write_sequence);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_5TH,
-		    &mrioc->sysif_regs->write_sequence);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_6TH,
-		    &mrioc->sysif_regs->write_sequence);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_FLUSH);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_1ST);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_2ND);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_3RD);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_4TH);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_5TH);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_6TH);
 		usleep_range(1000, 1100);
-		host_diagnostic = readl(&mrioc->sysif_regs->host_diagnostic);
+		host_diagnostic = mpi3mr_sysif_readl(mrioc, host_diagnostic);
 		ioc_info(mrioc,
 		    "wrote magic sequence: retry_count(%d), host_diagnostic(0x%08x)\n",
 		    unlock_retry_count, host_diagnostic);
 	} while (!(host_diagnostic & MPI3_SYSIF_HOST_DIAG_DIAG_WRITE_ENABLE));
 
-	writel(reset_reason, &mrioc->sysif_regs->scratchpad[0]);
+	mpi3mr_sysif_writel(mrioc, scratchpad[0], reset_reason);
 	ioc_info(mrioc, "%s reset due to %s(0x%x)\n",
 	    mpi3mr_reset_type_name(reset_type),
 	    mpi3mr_reset_rc_name(reset_reason), reset_reason);
-	writel(host_diagnostic | reset_type,
-	    &mrioc->sysif_regs->host_diagnostic);
+	mpi3mr_sysif_writel(mrioc, host_diagnostic,
+	    host_diagnostic | reset_type);
 	timeout = mrioc->ready_timeout * 10;
 	if (reset_type == MPI3_SYSIF_HOST_DIAG_RESET_ACTION_SOFT_RESET) {
 		do {
-			ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+			ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 			if (ioc_status &
 			    MPI3_SYSIF_IOC_STATUS_RESET_HISTORY) {
 				mpi3mr_clear_reset_history(mrioc);
 				ioc_config =
-				    readl(&mrioc->sysif_regs->ioc_configuration);
+				    mpi3mr_sysif_readl(mrioc, ioc_configuration);
 				if (mpi3mr_soft_reset_success(ioc_status,
 				    ioc_config)) {
 					retval = 0;
@@ -1154,11 +1342,11 @@ retry_reset:
 			}
 			msleep(100);
 		} while (--timeout);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_2ND,
-		    &mrioc->sysif_regs->write_sequence);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_2ND);
 	} else if (reset_type == MPI3_SYSIF_HOST_DIAG_RESET_ACTION_DIAG_FAULT) {
 		do {
-			ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+			ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 			if (mpi3mr_diagfault_success(mrioc, ioc_status)) {
 				retval = 0;
 				break;
@@ -1166,12 +1354,12 @@ retry_reset:
 			msleep(100);
 		} while (--timeout);
 		mpi3mr_clear_reset_history(mrioc);
-		writel(MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_2ND,
-		    &mrioc->sysif_regs->write_sequence);
+		mpi3mr_sysif_writel(mrioc, write_sequence,
+		    MPI3_SYSIF_WRITE_SEQUENCE_KEY_VALUE_2ND);
 	}
 	if (retval && ((++reset_retry_count) < MPI3MR_MAX_RESET_RETRY_COUNT)) {
-		ioc_status = readl(&mrioc->sysif_regs->ioc_status);
-		ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+		ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
+		ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 		ioc_info(mrioc,
 		    "Base IOC Sts/Config after reset try %d is (0x%x)/(0x%x)\n",
 		    reset_retry_count, ioc_status, ioc_config);
@@ -1180,8 +1368,8 @@ retry_reset:
 
 out:
 	pci_cfg_access_unlock(mrioc->pdev);
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 
 	ioc_info(mrioc,
 	    "Base IOC Sts/Config after %s reset is (0x%x)/(0x%x)\n",
@@ -1240,7 +1428,7 @@ int mpi3mr_admin_request_post(struct mpi3mr_ioc *mrioc, void *admin_req,
 		areq_pi = 0;
 	mrioc->admin_req_pi = areq_pi;
 
-	writel(mrioc->admin_req_pi, &mrioc->sysif_regs->admin_request_queue_pi);
+	mpi3mr_sysif_writel(mrioc, admin_request_queue_pi, mrioc->admin_req_pi);
 
 out:
 	spin_unlock_irqrestore(&mrioc->admin_req_lock, flags);
@@ -1564,6 +1752,8 @@ static int mpi3mr_create_op_reply_q(struct mpi3mr_ioc *mrioc, u16 qidx)
 
 	reply_qid = qidx + 1;
 	op_reply_q->num_replies = MPI3MR_OP_REP_Q_QD;
+	op_reply_q->fill_wmark = (op_reply_q->num_replies *
+	    MPI3MR_OP_REP_Q_FILL_WMARK_PCT) / 100;
 	op_reply_q->ci = 0;
 	op_reply_q->ephase = 1;
 	atomic_set(&op_reply_q->pend_ios, 0);
@@ -1832,23 +2022,25 @@ out_failed:
  * @mrioc: Adapter reference
  * @op_req_q: Operational request queue info
  * @req: MPI3 request
+ * @seq: Issue sequence number place holder or NULL
  *
  * Post the MPI3 request into operational request queue and
  * inform the controller, if the queue is full return
- * appropriate error.
+ * appropriate error.  When @seq is given, the next non-zero
+ * sequence number of the queue is stored in it under the queue
+ * lock before the controller is informed, so the sequence
+ * number is set only for a request which is posted.
  *
  * Return: 0 on success, non-zero on failure.
  */
 int mpi3mr_op_request_post(struct mpi3mr_ioc *mrioc,
-	struct op_req_qinfo *op_req_q, u8 *req)
+	struct op_req_qinfo *op_req_q, u8 *req, u32 *seq)
 {
 	u16 pi = 0, max_entries, reply_qidx = 0, midx;
 	int retval = 0;
 	unsigned long flags;
 	u8 *req_entry;
-	void *segment_base_addr;
 	u16 req_sz = mrioc->facts.op_req_sz;
-	struct segments *segments = op_req_q->q_segments;
 
 	reply_qidx = op_req_q->reply_qid - 1;
 
@@ -1876,9 +2068,7 @@ int mpi3mr_op_request_post(struct mpi3mr_ioc *mrioc,
 		goto out;
 	}
 
-	segment_base_addr = segments[pi / op_req_q->segment_qd].segment;
-	req_entry = (u8 *)segment_base_addr +
-	    ((pi % op_req_q->segment_qd) * req_sz);
+	req_entry = mpi3mr_get_req_entry(op_req_q, pi, req_sz);
 
 	memset(req_entry, 0, req_sz);
 	memcpy(req_entry, req, MPI3MR_ADMIN_REQ_FRAME_SZ);
@@ -1891,13 +2081,22 @@ int mpi3mr_op_request_post(struct mpi3mr_ioc *mrioc,
 	    > MPI3MR_IRQ_POLL_TRIGGER_IOCOUNT)
 		mrioc->op_reply_qinfo[reply_qidx].enable_irq_poll = true;
 
-	writel(op_req_q->pi,
-	    &mrioc->sysif_regs->oper_queue_indexes[reply_qidx].producer_index);
+	if (seq) {
+		/* Zero marks a request not posted yet */
+		if (!++op_req_q->io_seq)
+			++op_req_q->io_seq;
+		WRITE_ONCE(*seq, op_req_q->io_seq);
+	}
+
+	mpi3mr_op_req_q_doorbell(mrioc, reply_qidx, op_req_q->pi);
 
 out:
 	spin_unlock_irqrestore(&op_req_q->q_lock, flags);
 	return retval;
 }
+#if IS_ENABLED(CONFIG_SCSI_MPI3MR_KUNIT_TEST)
+EXPORT_SYMBOL_GPL(mpi3mr_op_request_post);
+#endif
 
 /**
  * mpi3mr_sync_timestamp - Issue time stamp sync request
@@ -1993,9 +2192,9 @@ static void mpi3mr_watchdog_work(struct work_struct *work)
 	/*Check for fault state every one second and issue Soft reset*/
 	ioc_state = mpi3mr_get_iocstate(mrioc);
 	if (ioc_state == MRIOC_STATE_FAULT) {
-		fault = readl(&mrioc->sysif_regs->fault) &
+		fault = mpi3mr_sysif_readl(mrioc, fault) &
 		    MPI3_SYSIF_FAULT_CODE_MASK;
-		host_diagnostic = readl(&mrioc->sysif_regs->host_diagnostic);
+		host_diagnostic = mpi3mr_sysif_readl(mrioc, host_diagnostic);
 		if (host_diagnostic & MPI3_SYSIF_HOST_DIAG_SAVE_IN_PROGRESS) {
 			if (!mrioc->diagsave_timeout) {
 				mpi3mr_print_fault_info(mrioc);
@@ -2028,6 +2227,30 @@ static void mpi3mr_watchdog_work(struct work_struct *work)
 			    MPI3MR_RESET_FROM_FAULT_WATCH, 0);
 	}
 
+	/*
+	 * Resume I/O quiesced for a reset announced by the firmware if the
+	 * reset does not happen.  The resume only tries the reset mutex,
+	 * a reset started meanwhile resumes the I/O itself.
+	 */
+	if (mrioc->prepare_for_reset && !mrioc->reset_in_progress &&
+	    (++mrioc->prepare_for_reset_timeout_counter >=
+	    MPI3MR_PREPARE_FOR_RESET_TIMEOUT)) {
+		ioc_warn(mrioc,
+		    "announced controller reset did not occur in %d seconds\n",
+		    MPI3MR_PREPARE_FOR_RESET_TIMEOUT);
+		mpi3mr_prepare_for_reset_end(mrioc);
+	}
+
+	/*
+	 * Expose the devices held back by a SAS discovery or PCIe
+	 * enumeration which stopped reporting progress.
+	 */
+	if (mpi3mr_discovery_pending(mrioc) && !mrioc->reset_in_progress &&
+	    (++mrioc->disc_timeout_counter >= MPI3MR_DISCOVERY_TIMEOUT))
+		mpi3mr_discovery_timeout(mrioc);
+
+	mpi3mr_count_active_luns(mrioc);
+
 schedule_work:
 	spin_lock_irqsave(&mrioc->watchdog_lock, flags);
 	if (mrioc->watchdog_work_q)
@@ -2178,13 +2401,13 @@ static int mpi3mr_setup_admin_qpair(struct mpi3mr_ioc *mrioc)
 
 	num_admin_entries = (mrioc->num_admin_replies << 16) |
 	    (mrioc->num_admin_req);
-	writel(num_admin_entries, &mrioc->sysif_regs->admin_queue_num_entries);
-	mpi3mr_writeq(mrioc->admin_req_dma,
-	    &mrioc->sysif_regs->admin_request_queue_address);
-	mpi3mr_writeq(mrioc->admin_reply_dma,
-	    &mrioc->sysif_regs->admin_reply_queue_address);
-	writel(mrioc->admin_req_pi, &mrioc->sysif_regs->admin_request_queue_pi);
-	writel(mrioc->admin_reply_ci, &mrioc->sysif_regs->admin_reply_queue_ci);
+	mpi3mr_sysif_writel(mrioc, admin_queue_num_entries, num_admin_entries);
+	mpi3mr_sysif_writeq(mrioc, admin_request_queue_address,
+	    mrioc->admin_req_dma);
+	mpi3mr_sysif_writeq(mrioc, admin_reply_queue_address,
+	    mrioc->admin_reply_dma);
+	mpi3mr_sysif_writel(mrioc, admin_request_queue_pi, mrioc->admin_req_pi);
+	mpi3mr_sysif_writel(mrioc, admin_reply_queue_ci, mrioc->admin_reply_ci);
 	return retval;
 
 out_failed:
@@ -2341,7 +2564,7 @@ static void mpi3mr_process_factsdata(struct mpi3mr_ioc *mrioc,
 		    le16_to_cpu(facts_data->ioc_facts_data_length) * 4);
 	}
 
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 	req_sz = 1 << ((ioc_config & MPI3_SYSIF_IOC_CONFIG_OPER_REQ_ENT_SZ) >>
 	    MPI3_SYSIF_IOC_CONFIG_OPER_REQ_ENT_SZ_SHIFT);
 	if (le16_to_cpu(facts_data->ioc_request_frame_size) != (req_sz / 4)) {
@@ -3239,13 +3462,13 @@ int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init)
 		}
 	}
 
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 
 	ioc_info(mrioc, "SOD status %x configuration %x\n",
 	    ioc_status, ioc_config);
 
-	base_info = lo_hi_readq(&mrioc->sysif_regs->ioc_information);
+	base_info = mpi3mr_sysif_readq(mrioc, ioc_information);
 	ioc_info(mrioc, "SOD base_info %llx\n",	base_info);
 
 	/*The timeout value is in 2sec unit, changing it to seconds*/
@@ -3312,6 +3535,7 @@ int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init)
 		    retval);
 		goto out_failed;
 	}
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_READY);
 
 	if (!re_init) {
 		retval = mpi3mr_setup_isr(mrioc, 1);
@@ -3366,12 +3590,12 @@ int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init)
 		goto out_failed;
 	}
 	mrioc->reply_free_queue_host_index = mrioc->num_reply_bufs;
-	writel(mrioc->reply_free_queue_host_index,
-	    &mrioc->sysif_regs->reply_free_host_index);
+	mpi3mr_sysif_writel(mrioc, reply_free_host_index,
+	    mrioc->reply_free_queue_host_index);
 
 	mrioc->sbq_host_index = mrioc->num_sense_bufs;
-	writel(mrioc->sbq_host_index,
-	    &mrioc->sysif_regs->sense_buffer_free_host_index);
+	mpi3mr_sysif_writel(mrioc, sense_buffer_free_host_index,
+	    mrioc->sbq_host_index);
 
 	if (!re_init)  {
 		retval = mpi3mr_setup_isr(mrioc, 0);
@@ -3396,6 +3620,7 @@ int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init)
 		    mrioc->shost->nr_hw_queues, mrioc->num_op_reply_q);
 		goto out_failed;
 	}
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_QUEUE_CREATE);
 
 	for (i = 0; i < MPI3_EVENT_NOTIFY_EVENTMASK_WORDS; i++)
 		mrioc->event_masks[i] = -1;
@@ -3403,15 +3628,13 @@ int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init)
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_DEVICE_ADDED);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_DEVICE_INFO_CHANGED);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_DEVICE_STATUS_CHANGE);
-	mpi3mr_unmask_events(mrioc, MPI3_EVENT_ENCL_DEVICE_STATUS_CHANGE);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_SAS_TOPOLOGY_CHANGE_LIST);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_SAS_DISCOVERY);
-	mpi3mr_unmask_events(mrioc, MPI3_EVENT_SAS_DEVICE_DISCOVERY_ERROR);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_SAS_BROADCAST_PRIMITIVE);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_PCIE_TOPOLOGY_CHANGE_LIST);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_PCIE_ENUMERATION);
-	mpi3mr_unmask_events(mrioc, MPI3_EVENT_CABLE_MGMT);
 	mpi3mr_unmask_events(mrioc, MPI3_EVENT_ENERGY_PACK_CHANGE);
+	mpi3mr_unmask_events(mrioc, MPI3_EVENT_PREPARE_FOR_RESET);
 
 	retval = mpi3mr_issue_event_notification(mrioc);
 	if (retval) {
@@ -3428,6 +3651,7 @@ int mpi3mr_init_ioc(struct mpi3mr_ioc *mrioc, u8 re_init)
 			    retval);
 			goto out_failed;
 		}
+		mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_PORT_ENABLE);
 	}
 	return retval;
 
@@ -3664,24 +3888,24 @@ static void mpi3mr_issue_ioc_shutdown(struct mpi3mr_ioc *mrioc)
 		    "IOC is unrecoverable shutdown is not issued\n");
 		return;
 	}
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 	if ((ioc_status & MPI3_SYSIF_IOC_STATUS_SHUTDOWN_MASK)
 	    == MPI3_SYSIF_IOC_STATUS_SHUTDOWN_IN_PROGRESS) {
 		ioc_info(mrioc, "shutdown already in progress\n");
 		return;
 	}
 
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 	ioc_config |= MPI3_SYSIF_IOC_CONFIG_SHUTDOWN_NORMAL;
 	ioc_config |= MPI3_SYSIF_IOC_CONFIG_DEVICE_SHUTDOWN;
 
-	writel(ioc_config, &mrioc->sysif_regs->ioc_configuration);
+	mpi3mr_sysif_writel(mrioc, ioc_configuration, ioc_config);
 
 	if (mrioc->facts.shutdown_timeout)
 		timeout = mrioc->facts.shutdown_timeout * 10;
 
 	do {
-		ioc_status = readl(&mrioc->sysif_regs->ioc_status);
+		ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
 		if ((ioc_status & MPI3_SYSIF_IOC_STATUS_SHUTDOWN_MASK)
 		    == MPI3_SYSIF_IOC_STATUS_SHUTDOWN_COMPLETE) {
 			retval = 0;
@@ -3690,8 +3914,8 @@ static void mpi3mr_issue_ioc_shutdown(struct mpi3mr_ioc *mrioc)
 		msleep(100);
 	} while (--timeout);
 
-	ioc_status = readl(&mrioc->sysif_regs->ioc_status);
-	ioc_config = readl(&mrioc->sysif_regs->ioc_configuration);
+	ioc_status = mpi3mr_sysif_readl(mrioc, ioc_status);
+	ioc_config = mpi3mr_sysif_readl(mrioc, ioc_configuration);
 
 	if (retval) {
 		if ((ioc_status & MPI3_SYSIF_IOC_STATUS_SHUTDOWN_MASK)
@@ -3809,23 +4033,40 @@ int mpi3mr_diagfault_reset_handler(struct mpi3mr_ioc *mrioc,
 	u32 reset_reason)
 {
 	int retval = 0;
+	u16 i;
 
 	ioc_info(mrioc, "Entry: reason code: %s\n",
 	    mpi3mr_reset_rc_name(reset_reason));
 	mrioc->reset_in_progress = 1;
+	mpi3mr_update_host_io_state(mrioc);
+	mpi3mr_reset_history_start(mrioc, reset_reason,
+	    MPI3_SYSIF_HOST_DIAG_RESET_ACTION_DIAG_FAULT);
 
 	mpi3mr_ioc_disable_intr(mrioc);
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_IO_BLOCK);
+
+	/*
+	 * The I/Os outstanding at the fault are flushed by the soft reset
+	 * recovering the controller, record how many the fault strands.
+	 */
+	for (i = 0; i < mrioc->num_op_reply_q; i++)
+		mrioc->reset_rec.flush_io_count +=
+		    atomic_read(&mrioc->op_reply_qinfo[i].pend_ios);
 
 	retval = mpi3mr_issue_reset(mrioc,
 	    MPI3_SYSIF_HOST_DIAG_RESET_ACTION_DIAG_FAULT, reset_reason);
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_FW_RESET);
 
 	if (retval) {
 		ioc_err(mrioc, "The diag fault reset failed: reason %d\n",
 		    reset_reason);
 		mpi3mr_ioc_enable_intr(mrioc);
+		mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_IO_RESUME);
 	}
 	ioc_info(mrioc, "%s\n", ((retval == 0) ? "SUCCESS" : "FAILED"));
 	mrioc->reset_in_progress = 0;
+	mpi3mr_update_host_io_state(mrioc);
+	mpi3mr_reset_history_end(mrioc, !retval);
 	return retval;
 }
 
@@ -3872,6 +4113,10 @@ int mpi3mr_soft_reset_handler(struct mpi3mr_ioc *mrioc,
 		return -1;
 	}
 	mrioc->reset_in_progress = 1;
+	mpi3mr_update_host_io_state(mrioc);
+	mpi3mr_reset_history_start(mrioc, reset_reason,
+	    MPI3_SYSIF_HOST_DIAG_RESET_ACTION_SOFT_RESET);
+	mpi3mr_block_host_io(mrioc);
 
 	if ((!snapdump) && (reset_reason != MPI3MR_RESET_FROM_FAULT_WATCH) &&
 	    (reset_reason != MPI3MR_RESET_FROM_CIACTIV_FAULT)) {
@@ -3890,6 +4135,7 @@ int mpi3mr_soft_reset_handler(struct mpi3mr_ioc *mrioc,
 	mpi3mr_wait_for_host_io(mrioc, MPI3MR_RESET_HOST_IOWAIT_TIMEOUT);
 
 	mpi3mr_ioc_disable_intr(mrioc);
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_IO_BLOCK);
 
 	if (snapdump) {
 		mpi3mr_set_diagsave(mrioc);
@@ -3898,7 +4144,7 @@ int mpi3mr_soft_reset_handler(struct mpi3mr_ioc *mrioc,
 		if (!retval) {
 			do {
 				host_diagnostic =
-				    readl(&mrioc->sysif_regs->host_diagnostic);
+				    mpi3mr_sysif_readl(mrioc, host_diagnostic);
 				if (!(host_diagnostic &
 				    MPI3_SYSIF_HOST_DIAG_SAVE_IN_PROGRESS))
 					break;
@@ -3919,9 +4165,15 @@ int mpi3mr_soft_reset_handler(struct mpi3mr_ioc *mrioc,
 	memset(mrioc->devrem_bitmap, 0, mrioc->devrem_bitmap_sz);
 	memset(mrioc->removepend_bitmap, 0, mrioc->dev_handle_bitmap_sz);
 	mpi3mr_cleanup_fwevt_list(mrioc);
+	bitmap_zero(mrioc->sas_disc_ports, MPI3MR_NUM_IOU_PORTS);
+	bitmap_zero(mrioc->pcie_enum_ports, MPI3MR_NUM_IOU_PORTS);
+	mrioc->disc_timeout_counter = 0;
+	atomic_set(&mrioc->bcast_pending, 0);
 	mpi3mr_flush_host_io(mrioc);
+	mrioc->reset_rec.flush_io_count = mrioc->flush_io_count;
 	mpi3mr_invalidate_devhandles(mrioc);
 	mpi3mr_memset_buffers(mrioc);
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_FW_RESET);
 	retval = mpi3mr_init_ioc(mrioc, 1);
 	if (retval) {
 		pr_err(IOCNAME "reinit after soft reset failed: reason %d\n",
@@ -3929,12 +4181,23 @@ int mpi3mr_soft_reset_handler(struct mpi3mr_ioc *mrioc,
 		goto out;
 	}
 	ssleep(10);
+	mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_FW_SETTLE);
 
 out:
 	if (!retval) {
 		mrioc->reset_in_progress = 0;
+		mrioc->prepare_for_reset = 0;
+		mpi3mr_update_host_io_state(mrioc);
 		scsi_unblock_requests(mrioc->shost);
-		mpi3mr_rfresh_tgtdevs(mrioc);
+		mpi3mr_unblock_host_io(mrioc);
+		mpi3mr_reset_phase_done(mrioc, MPI3MR_RESET_PHASE_IO_RESUME);
+		/*
+		 * Target devices are created by the event bottom half, the
+		 * refresh is queued behind the device added events posted
+		 * during port enable so that devices present after the reset
+		 * are not removed.
+		 */
+		mpi3mr_tgtdev_refresh_evt(mrioc);
 		mrioc->ts_update_counter = 0;
 		spin_lock_irqsave(&mrioc->watchdog_lock, flags);
 		if (mrioc->watchdog_work_q)
@@ -3947,8 +4210,12 @@ out:
 		    MPI3_SYSIF_HOST_DIAG_RESET_ACTION_DIAG_FAULT, reset_reason);
 		mrioc->unrecoverable = 1;
 		mrioc->reset_in_progress = 0;
+		mrioc->prepare_for_reset = 0;
+		mpi3mr_update_host_io_state(mrioc);
 		retval = -1;
+		mpi3mr_unblock_host_io(mrioc);
 	}
+	mpi3mr_reset_history_end(mrioc, !retval);
 
 	mutex_unlock(&mrioc->reset_mutex);
 	ioc_info(mrioc, "%s\n", ((retval == 0) ? "SUCCESS" : "FAILED"));
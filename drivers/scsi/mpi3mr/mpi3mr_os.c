@@ -33,6 +33,21 @@ module_param(logging_level, int, 0);
 MODULE_PARM_DESC(logging_level,
 	" bits for enabling additional logging info (default=0)");
 
+static int vd_degraded_qd_pct = MPI3MR_VD_DEGRADED_QD_PCT;
+module_param(vd_degraded_qd_pct, int, 0444);
+MODULE_PARM_DESC(vd_degraded_qd_pct,
+	" degraded volume queue depth, percent of optimal (default=50)");
+
+static int vd_degraded_io_timeout = MPI3MR_VD_DEGRADED_IO_TIMEOUT;
+module_param(vd_degraded_io_timeout, int, 0444);
+MODULE_PARM_DESC(vd_degraded_io_timeout,
+	" degraded volume I/O timeout in seconds (default=180)");
+
+static int vd_degraded_max_sectors = MPI3MR_VD_DEGRADED_MAX_SECTORS;
+module_param(vd_degraded_max_sectors, int, 0444);
+MODULE_PARM_DESC(vd_degraded_max_sectors,
+	" degraded volume max I/O size in sectors, 0 unlimited (default=512)");
+
 /* Forward declarations*/
 /**
  * mpi3mr_host_tag_for_scmd - Get host tag for a scmd
@@ -47,6 +62,8 @@ static u16 mpi3mr_host_tag_for_scmd(struct mpi3mr_ioc *mrioc,
 	struct scsi_cmnd *scmd)
 {
 	struct scmd_priv *priv = NULL;
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = scmd->device->hostdata;
+	struct mpi3mr_stgt_priv_data *stgt_priv_data;
 	u32 unique_tag;
 	u16 host_tag, hw_queue;
 
@@ -66,9 +83,13 @@ static u16 mpi3mr_host_tag_for_scmd(struct mpi3mr_ioc *mrioc,
 	priv->scmd = scmd;
 	priv->in_lld_scope = 1;
 	priv->req_q_idx = hw_queue;
+	priv->seq = 0;
 	priv->meta_chain_idx = -1;
 	priv->chain_idx = -1;
 	priv->meta_sg_valid = 0;
+	stgt_priv_data = sdev_priv_data->tgt_priv_data;
+	if (hw_queue < stgt_priv_data->num_q_io_pend)
+		atomic_inc(&stgt_priv_data->q_io_pend[hw_queue]);
 	return priv->host_tag;
 }
 
@@ -119,11 +140,16 @@ static void mpi3mr_clear_scmd_priv(struct mpi3mr_ioc *mrioc,
 	struct scsi_cmnd *scmd)
 {
 	struct scmd_priv *priv = NULL;
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = scmd->device->hostdata;
+	struct mpi3mr_stgt_priv_data *stgt_priv_data;
 
 	priv = scsi_cmd_priv(scmd);
 
 	if (WARN_ON(priv->in_lld_scope == 0))
 		return;
+	stgt_priv_data = sdev_priv_data->tgt_priv_data;
+	if (priv->req_q_idx < stgt_priv_data->num_q_io_pend)
+		atomic_dec(&stgt_priv_data->q_io_pend[priv->req_q_idx]);
 	priv->host_tag = MPI3MR_HOSTTAG_INVALID;
 	priv->req_q_idx = 0xFFFF;
 	priv->scmd = NULL;
@@ -142,6 +168,12 @@ static void mpi3mr_clear_scmd_priv(struct mpi3mr_ioc *mrioc,
 static void mpi3mr_dev_rmhs_send_tm(struct mpi3mr_ioc *mrioc, u16 handle,
 	struct mpi3mr_drv_cmd *cmdparam, u8 iou_rc);
 static void mpi3mr_fwevt_worker(struct work_struct *work);
+static int mpi3mr_create_tgtdev(struct mpi3mr_ioc *mrioc,
+	struct mpi3_device_page0 *dev_pg0);
+static int mpi3mr_issue_tm(struct mpi3mr_ioc *mrioc, u8 tm_type,
+	u16 handle, uint lun, u16 htag, ulong timeout,
+	struct mpi3mr_drv_cmd *drv_cmd,
+	u8 *resp_code, struct scmd_priv *cmd_priv);
 
 /**
  * mpi3mr_fwevt_free - firmware event memory dealloctor
@@ -301,6 +333,14 @@ void mpi3mr_cleanup_fwevt_list(struct mpi3mr_ioc *mrioc)
 
 	while ((fwevt = mpi3mr_dequeue_fwevt(mrioc)) ||
 	    (fwevt = mrioc->current_event)) {
+		/*
+		 * The current event cannot be waited on when the cleanup
+		 * is done from its own bottom half, e.g. a controller
+		 * reset on a task management timeout.
+		 */
+		if (fwevt == mrioc->current_event &&
+		    current_work() == &fwevt->work)
+			break;
 		/*
 		 * Wait on the fwevt to complete. If this returns 1, then
 		 * the event was never executed, and we need a put for the
@@ -324,6 +364,67 @@ void mpi3mr_cleanup_fwevt_list(struct mpi3mr_ioc *mrioc)
 	}
 }
 
+/**
+ * mpi3mr_int_reset_start - Firmware internal device reset started
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Record the start of an internal device or I_T nexus reset done
+ * by the firmware.  Until the reset completes the timers of the
+ * commands outstanding to the target are restarted on expiry by
+ * mpi3mr_eh_timed_out() and requeued commands do not count
+ * against the retry limit, so the reset is ended by
+ * mpi3mr_int_reset_timeout_work() if the firmware does not report
+ * its completion within MPI3MR_INT_RESET_MAX_TIMEOUT seconds.
+ *
+ * Return: true if no internal reset was in progress, else false.
+ */
+static bool mpi3mr_int_reset_start(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	if (scsi_tgt_priv_data->int_reset_ts)
+		return false;
+
+	WRITE_ONCE(scsi_tgt_priv_data->int_reset_ts, jiffies ?: 1);
+	scsi_tgt_priv_data->int_reset_count++;
+	schedule_delayed_work(&scsi_tgt_priv_data->int_reset_work,
+	    MPI3MR_INT_RESET_MAX_TIMEOUT * HZ);
+	return true;
+}
+
+/**
+ * mpi3mr_int_reset_end - Firmware internal device reset completed
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * End the internal device reset in progress on the target and
+ * account its duration.  The completion event and the timeout
+ * work may race to end the reset, only one of them gets true and
+ * drops the block reference taken at the start.
+ *
+ * Return: true if an internal reset was in progress, else false.
+ */
+static bool mpi3mr_int_reset_end(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	unsigned long int_reset_ts;
+	u32 duration;
+
+	int_reset_ts = xchg(&scsi_tgt_priv_data->int_reset_ts, 0);
+	if (!int_reset_ts)
+		return false;
+
+	cancel_delayed_work(&scsi_tgt_priv_data->int_reset_work);
+	duration = jiffies_to_msecs(jiffies - int_reset_ts);
+	scsi_tgt_priv_data->int_reset_time += duration;
+	if (duration > scsi_tgt_priv_data->int_reset_max)
+		scsi_tgt_priv_data->int_reset_max = duration;
+	ioc_info(mrioc,
+	    "internal reset of handle(0x%04x) ended after %u ms\n",
+	    scsi_tgt_priv_data->dev_handle, duration);
+	return true;
+}
+
 /**
  * mpi3mr_invalidate_devhandles -Invalidate device handles
  * @mrioc: Adapter instance reference
@@ -342,7 +443,16 @@ void mpi3mr_invalidate_devhandles(struct mpi3mr_ioc *mrioc)
 		tgtdev->dev_handle = MPI3MR_INVALID_DEV_HANDLE;
 		if (tgtdev->starget && tgtdev->starget->hostdata) {
 			tgt_priv = tgtdev->starget->hostdata;
-			tgt_priv->dev_handle = MPI3MR_INVALID_DEV_HANDLE;
+			/*
+			 * The completion of an internal device reset is not
+			 * reported across a controller reset, drop its block
+			 * reference; the request queues are restarted at the
+			 * end of the controller reset.
+			 */
+			if (mpi3mr_int_reset_end(mrioc, tgt_priv))
+				mpi3mr_unblock_tgt_io(mrioc, tgt_priv);
+			mpi3mr_set_tgt_handle(tgt_priv,
+			    MPI3MR_INVALID_DEV_HANDLE);
 		}
 	}
 }
@@ -435,10 +545,423 @@ void mpi3mr_flush_host_io(struct mpi3mr_ioc *mrioc)
 	ioc_info(mrioc, "%s :Flushing Host I/O cmds post reset\n", __func__);
 	blk_mq_tagset_busy_iter(&shost->tag_set,
 	    mpi3mr_flush_scmd, (void *)mrioc);
-	ioc_info(mrioc, "%s :Flushed %d Host I/O cmds\n", __func__,
+	ioc_info(mrioc, "%s :Flushed %u Host I/O cmds\n", __func__,
 	    mrioc->flush_io_count);
 }
 
+/**
+ * mpi3mr_quiesce_sdev - Stop block layer dispatch to a device
+ * @sdev: SCSI device reference
+ * @data: Unused
+ *
+ * Move a running device to the blocked state so that the block
+ * layer holds new requests instead of dispatching them to the
+ * driver only to have them returned busy, and remember that the
+ * driver quiesced it. Devices in any other state are left
+ * untouched.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_quiesce_sdev(struct scsi_device *sdev, void *data)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+
+	if (!sdev_priv_data || sdev->sdev_state != SDEV_RUNNING)
+		return;
+	if (!scsi_internal_device_block_nowait(sdev))
+		sdev_priv_data->io_quiesced = 1;
+}
+
+/**
+ * mpi3mr_unquiesce_sdev - Resume block layer dispatch to a device
+ * @sdev: SCSI device reference
+ * @data: Unused
+ *
+ * Move a device quiesced by the driver back to the running state
+ * unless I/O to its target is still blocked. Devices blocked by
+ * the midlayer or a transport are left untouched.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_unquiesce_sdev(struct scsi_device *sdev, void *data)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+
+	if (!sdev_priv_data || !sdev_priv_data->io_quiesced)
+		return;
+	if (sdev_priv_data->tgt_priv_data &&
+	    atomic_read(&sdev_priv_data->tgt_priv_data->block_io))
+		return;
+	sdev_priv_data->io_quiesced = 0;
+	if (sdev->sdev_state == SDEV_BLOCK)
+		scsi_internal_device_unblock_nowait(sdev, SDEV_RUNNING);
+}
+
+/**
+ * mpi3mr_sync_sdev_io_block - Match device dispatch to its target
+ * @sdev: SCSI device reference
+ * @data: Unused
+ *
+ * Quiesce the device when I/O to its target is blocked and resume
+ * it otherwise.  Devices of a target under controller reset are
+ * left to the reset handling.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_sync_sdev_io_block(struct scsi_device *sdev, void *data)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data;
+
+	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data)
+		return;
+	scsi_tgt_priv_data = sdev_priv_data->tgt_priv_data;
+	if (test_bit(MPI3MR_TGT_IO_HOST_RESET, &scsi_tgt_priv_data->io_state))
+		return;
+	if (atomic_read(&scsi_tgt_priv_data->block_io))
+		mpi3mr_quiesce_sdev(sdev, NULL);
+	else
+		mpi3mr_unquiesce_sdev(sdev, NULL);
+}
+
+/**
+ * mpi3mr_tgt_io_block_sdev - Match device dispatch under the lock
+ * @sdev: SCSI device reference
+ * @data: Unused
+ *
+ * Check the block state of the target and quiesce or resume the
+ * device under the tgtdev_lock, so that a quiesce cannot race
+ * with the resume done by the last unblock of the target.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_tgt_io_block_sdev(struct scsi_device *sdev, void *data)
+{
+	struct mpi3mr_ioc *mrioc = shost_priv(sdev->host);
+	unsigned long flags;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	mpi3mr_sync_sdev_io_block(sdev, NULL);
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+}
+
+/**
+ * mpi3mr_tgt_io_block_work - Quiesce the devices of a blocked target
+ * @work: Block work of the target
+ *
+ * Queued when the first block reference on a target is taken,
+ * quiesce the request queues of the devices of that target unless
+ * the target was unblocked meanwhile.  This runs on the system
+ * workqueue, as taking the device references may sleep.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_tgt_io_block_work(struct work_struct *work)
+{
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data =
+	    container_of(work, struct mpi3mr_stgt_priv_data, io_block_work);
+
+	starget_for_each_device(scsi_tgt_priv_data->starget, NULL,
+	    mpi3mr_tgt_io_block_sdev);
+}
+
+/**
+ * mpi3mr_tgt_io_resume - Resume the devices of an unblocked target
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Restart the request queues the driver quiesced on the devices
+ * of the target right away, the restart does not sleep.  The
+ * devices are walked under the host lock without taking device
+ * references.  The caller must hold the tgtdev_lock.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_tgt_io_resume(
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	struct scsi_target *starget = scsi_tgt_priv_data->starget;
+	struct Scsi_Host *shost = dev_to_shost(&starget->dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(shost->host_lock, flags);
+	__starget_for_each_device(starget, NULL, mpi3mr_sync_sdev_io_block);
+	spin_unlock_irqrestore(shost->host_lock, flags);
+}
+
+/**
+ * __mpi3mr_block_tgt_io - Block I/O to a target
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Take a block reference on the target. On the first reference
+ * mark its I/O blocked, so that new commands are returned busy,
+ * and queue the quiesce of its request queues. The caller must
+ * hold the tgtdev_lock.
+ *
+ * Return: Nothing.
+ */
+static void __mpi3mr_block_tgt_io(
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	if (atomic_inc_return(&scsi_tgt_priv_data->block_io) == 1) {
+		set_bit(MPI3MR_TGT_IO_BLOCKED, &scsi_tgt_priv_data->io_state);
+		schedule_work(&scsi_tgt_priv_data->io_block_work);
+	}
+}
+
+/**
+ * __mpi3mr_unblock_tgt_io - Unblock I/O to a target
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Drop a block reference on the target. When the last reference
+ * is dropped mark its I/O unblocked and restart its request
+ * queues. The caller must hold the tgtdev_lock.
+ *
+ * Return: Nothing.
+ */
+static void __mpi3mr_unblock_tgt_io(
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	if (!atomic_dec_if_positive(&scsi_tgt_priv_data->block_io)) {
+		clear_bit(MPI3MR_TGT_IO_BLOCKED,
+		    &scsi_tgt_priv_data->io_state);
+		mpi3mr_tgt_io_resume(scsi_tgt_priv_data);
+	}
+}
+
+/**
+ * __mpi3mr_release_tgt_io - Drop all I/O blocks on a target
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Clear every block reference on the target and restart its
+ * request queues, so that the I/Os held by the block layer are
+ * failed quickly once the device is removed. The caller must hold
+ * the tgtdev_lock.
+ *
+ * Return: Nothing.
+ */
+static void __mpi3mr_release_tgt_io(
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	if (atomic_xchg(&scsi_tgt_priv_data->block_io, 0)) {
+		clear_bit(MPI3MR_TGT_IO_BLOCKED,
+		    &scsi_tgt_priv_data->io_state);
+		mpi3mr_tgt_io_resume(scsi_tgt_priv_data);
+	}
+}
+
+/**
+ * mpi3mr_block_tgt_io - Block I/O to a target
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Take a block reference on the target and quiesce the request
+ * queues of all its devices on the first reference. Safe from the
+ * event top halves, the quiesce is done by the block work of the
+ * target.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_block_tgt_io(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	__mpi3mr_block_tgt_io(scsi_tgt_priv_data);
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+}
+
+/**
+ * mpi3mr_unblock_tgt_io - Unblock I/O to a target
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Drop a block reference on the target and restart the request
+ * queues of all its devices when the last reference is dropped.
+ * Safe from the event top halves, the restart does not sleep.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_unblock_tgt_io(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	__mpi3mr_unblock_tgt_io(scsi_tgt_priv_data);
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+}
+
+/**
+ * mpi3mr_release_tgt_io - Drop all I/O blocks on a target
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Clear every block reference on the target and restart the
+ * request queues of its devices, so that the I/Os held by the
+ * block layer are failed quickly once the device is removed.
+ * Safe from the event top halves, the restart does not sleep.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_release_tgt_io(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	__mpi3mr_release_tgt_io(scsi_tgt_priv_data);
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+}
+
+/**
+ * mpi3mr_int_reset_timeout_work - End an overdue internal reset
+ * @work: Delayed work of the target
+ *
+ * Armed by mpi3mr_int_reset_start(), end an internal device
+ * reset whose completion the firmware did not report within
+ * MPI3MR_INT_RESET_MAX_TIMEOUT seconds and resume I/O to the
+ * target, so that the commands held or requeued for it are
+ * handled by the regular timeout and retry limits again.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_int_reset_timeout_work(struct work_struct *work)
+{
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data =
+	    container_of(work, struct mpi3mr_stgt_priv_data,
+	    int_reset_work.work);
+	struct scsi_target *starget = scsi_tgt_priv_data->starget;
+	struct mpi3mr_ioc *mrioc = shost_priv(dev_to_shost(&starget->dev));
+
+	if (!mpi3mr_int_reset_end(mrioc, scsi_tgt_priv_data))
+		return;
+
+	ioc_warn(mrioc,
+	    "internal reset of handle(0x%04x) not completed in %d seconds, resuming I/O\n",
+	    scsi_tgt_priv_data->dev_handle, MPI3MR_INT_RESET_MAX_TIMEOUT);
+	mpi3mr_unblock_tgt_io(mrioc, scsi_tgt_priv_data);
+}
+
+/**
+ * mpi3mr_block_host_io - Block I/O to all devices of the host
+ * @mrioc: Adapter instance reference
+ *
+ * Quiesce the request queues of all devices attached to the
+ * host, used for the duration of a controller reset.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_block_host_io(struct mpi3mr_ioc *mrioc)
+{
+	struct scsi_device *sdev;
+
+	shost_for_each_device(sdev, mrioc->shost)
+		mpi3mr_quiesce_sdev(sdev, NULL);
+}
+
+/**
+ * mpi3mr_unblock_host_io - Unblock I/O to all devices of the host
+ * @mrioc: Adapter instance reference
+ *
+ * Restart the request queues of the devices quiesced by the driver
+ * except the ones whose target still has I/O blocked.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_unblock_host_io(struct mpi3mr_ioc *mrioc)
+{
+	struct scsi_device *sdev;
+
+	shost_for_each_device(sdev, mrioc->shost)
+		mpi3mr_unquiesce_sdev(sdev, NULL);
+}
+
+/**
+ * mpi3mr_set_tgt_host_state - Propagate host state to a target
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: SCSI target private data
+ *
+ * Mirror the controller reset and driver stop flags into the
+ * I/O admission state of the target, a reset announced by the
+ * firmware counts as a reset in progress.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_set_tgt_host_state(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data)
+{
+	if (mrioc->reset_in_progress || mrioc->prepare_for_reset)
+		set_bit(MPI3MR_TGT_IO_HOST_RESET,
+		    &scsi_tgt_priv_data->io_state);
+	else
+		clear_bit(MPI3MR_TGT_IO_HOST_RESET,
+		    &scsi_tgt_priv_data->io_state);
+
+	if (mrioc->stop_drv_processing)
+		set_bit(MPI3MR_TGT_IO_HOST_STOP,
+		    &scsi_tgt_priv_data->io_state);
+	else
+		clear_bit(MPI3MR_TGT_IO_HOST_STOP,
+		    &scsi_tgt_priv_data->io_state);
+}
+
+/**
+ * mpi3mr_update_host_io_state - Propagate host state to targets
+ * @mrioc: Adapter instance reference
+ *
+ * Mirror the controller reset and driver stop flags into the
+ * I/O admission state of all targets exposed to the SCSI
+ * midlayer, to be called whenever either flag changes.  The
+ * targets are reached through the target device list under the
+ * tgtdev_lock, so no SCSI device reference is taken per LUN.
+ * Targets allocated later pick the flags up in
+ * mpi3mr_target_alloc() under the same lock.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_update_host_io_state(struct mpi3mr_ioc *mrioc)
+{
+	struct mpi3mr_tgt_dev *tgtdev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	list_for_each_entry(tgtdev, &mrioc->tgtdev_list, list) {
+		if (tgtdev->starget && tgtdev->starget->hostdata)
+			mpi3mr_set_tgt_host_state(mrioc,
+			    tgtdev->starget->hostdata);
+	}
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+}
+
+/**
+ * mpi3mr_prepare_for_reset_end - Resume I/O after announced reset
+ * @mrioc: Adapter instance reference
+ *
+ * Restart the I/O quiesced for a controller reset announced by
+ * the firmware, when the firmware aborts the reset or it does not
+ * happen in time.  The reset mutex is only tried: when it is
+ * held a controller reset is in progress and resumes the I/O
+ * itself once it completes.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_prepare_for_reset_end(struct mpi3mr_ioc *mrioc)
+{
+	if (!mutex_trylock(&mrioc->reset_mutex))
+		return;
+
+	if (mrioc->prepare_for_reset && !mrioc->reset_in_progress) {
+		ioc_info(mrioc,
+		    "resuming I/O quiesced for controller reset\n");
+		mrioc->prepare_for_reset = 0;
+		mrioc->prepare_for_reset_timeout_counter = 0;
+		mpi3mr_update_host_io_state(mrioc);
+		mpi3mr_unblock_host_io(mrioc);
+	}
+	mutex_unlock(&mrioc->reset_mutex);
+}
+
 /**
  * mpi3mr_alloc_tgtdev - target device allocator
  *
@@ -451,7 +974,7 @@ static struct mpi3mr_tgt_dev *mpi3mr_alloc_tgtdev(void)
 {
 	struct mpi3mr_tgt_dev *tgtdev;
 
-	tgtdev = kzalloc(sizeof(*tgtdev), GFP_ATOMIC);
+	tgtdev = kzalloc(sizeof(*tgtdev), GFP_KERNEL);
 	if (!tgtdev)
 		return NULL;
 	kref_init(&tgtdev->ref_count);
@@ -639,7 +1162,7 @@ static void mpi3mr_remove_tgtdev_from_host(struct mpi3mr_ioc *mrioc,
 	    __func__, tgtdev->dev_handle, (unsigned long long)tgtdev->wwid);
 	if (tgtdev->starget && tgtdev->starget->hostdata) {
 		tgt_priv = tgtdev->starget->hostdata;
-		tgt_priv->dev_handle = MPI3MR_INVALID_DEV_HANDLE;
+		mpi3mr_set_tgt_handle(tgt_priv, MPI3MR_INVALID_DEV_HANDLE);
 	}
 
 	if (tgtdev->starget) {
@@ -738,7 +1261,6 @@ mpi3mr_update_sdev(struct scsi_device *sdev, void *data)
 	if (!tgtdev)
 		return;
 
-	mpi3mr_change_queue_depth(sdev, tgtdev->q_depth);
 	switch (tgtdev->dev_type) {
 	case MPI3_DEVICE_DEVFORM_PCIE:
 		/*The block layer hw sector size = 512*/
@@ -754,19 +1276,313 @@ mpi3mr_update_sdev(struct scsi_device *sdev, void *data)
 }
 
 /**
- * mpi3mr_rfresh_tgtdevs - Refresh target device exposure
- * @mrioc: Adapter instance reference
- *
- * This is executed post controller reset to identify any
- * missing devices during reset and remove from the upper layers
- * or expose any newly detected device to the upper layers.
+ * mpi3mr_vd_degraded - Check whether a volume is degraded
+ * @tgtdev: Target device internal structure
  *
- * Return: Nothing.
+ * Return: true if the target is a degraded or partially degraded
+ * volume, including volumes being rebuilt, else false.
  */
-
-void mpi3mr_rfresh_tgtdevs(struct mpi3mr_ioc *mrioc)
+static bool mpi3mr_vd_degraded(struct mpi3mr_tgt_dev *tgtdev)
 {
-	struct mpi3mr_tgt_dev *tgtdev, *tgtdev_next;
+	if (tgtdev->dev_type != MPI3_DEVICE_DEVFORM_VD)
+		return false;
+
+	switch (tgtdev->dev_spec.vol_inf.state) {
+	case MPI3_DEVICE0_VD_STATE_PARTIALLY_DEGRADED:
+	case MPI3_DEVICE0_VD_STATE_DEGRADED:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * mpi3mr_vd_state_name - Name of a volume state
+ * @state: MPI3_DEVICE0_VD_STATE_* value
+ *
+ * Return: name of the volume state.
+ */
+static const char *mpi3mr_vd_state_name(u8 state)
+{
+	switch (state) {
+	case MPI3_DEVICE0_VD_STATE_OFFLINE:
+		return "offline";
+	case MPI3_DEVICE0_VD_STATE_PARTIALLY_DEGRADED:
+		return "partially_degraded";
+	case MPI3_DEVICE0_VD_STATE_DEGRADED:
+		return "degraded";
+	case MPI3_DEVICE0_VD_STATE_OPTIMAL:
+		return "optimal";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * mpi3mr_tgtdev_q_depth - Queue depth to apply to a target
+ * @tgtdev: Target device internal structure
+ *
+ * The queue depth reported by the firmware is scaled down to
+ * vd_degraded_qd_pct percent while a volume is degraded.
+ *
+ * Return: Queue depth, 0 for the driver default.
+ */
+static int mpi3mr_tgtdev_q_depth(struct mpi3mr_tgt_dev *tgtdev)
+{
+	int q_depth = tgtdev->q_depth;
+
+	if (!mpi3mr_vd_degraded(tgtdev) || vd_degraded_qd_pct <= 0 ||
+	    vd_degraded_qd_pct >= 100)
+		return q_depth;
+
+	if (!q_depth)
+		q_depth = MPI3MR_DEFAULT_SDEV_QD;
+
+	return max(q_depth * vd_degraded_qd_pct / 100, 1);
+}
+
+/**
+ * mpi3mr_update_sdev_vd_policy - Apply volume state I/O policy
+ * @sdev: SCSI device reference
+ * @data: target device reference
+ *
+ * This is an iterator function called for each SCSI device of a
+ * volume to apply the I/O policy of the current volume state.
+ * When the volume degrades, the maximum hardware I/O size and
+ * request timeout in effect are saved, the maximum hardware I/O
+ * size is limited to vd_degraded_max_sectors and the request
+ * timeout is set to vd_degraded_io_timeout.  A request timeout
+ * set by the user through the midlayer takes precedence and is
+ * left untouched.  When the volume recovers each saved value is
+ * restored only if it still holds the degraded value, so a
+ * change made meanwhile is kept.
+ *
+ * Return: Nothing.
+ */
+static void
+mpi3mr_update_sdev_vd_policy(struct scsi_device *sdev, void *data)
+{
+	struct mpi3mr_tgt_dev *tgtdev = (struct mpi3mr_tgt_dev *)data;
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	struct request_queue *q = sdev->request_queue;
+
+	if (!sdev_priv_data)
+		return;
+
+	if (mpi3mr_vd_degraded(tgtdev)) {
+		if (sdev_priv_data->vd_degraded_policy)
+			return;
+		sdev_priv_data->vd_degraded_policy = 1;
+		sdev_priv_data->vd_saved_max_hw_sectors =
+		    queue_max_hw_sectors(q);
+		sdev_priv_data->vd_saved_timeout = q->rq_timeout;
+		sdev_priv_data->vd_degraded_max_hw_sectors = 0;
+		sdev_priv_data->vd_degraded_timeout = 0;
+		if (vd_degraded_max_sectors > 0 &&
+		    queue_max_hw_sectors(q) > vd_degraded_max_sectors) {
+			blk_queue_max_hw_sectors(q, vd_degraded_max_sectors);
+			sdev_priv_data->vd_degraded_max_hw_sectors =
+			    queue_max_hw_sectors(q);
+		}
+		if (vd_degraded_io_timeout > 0 &&
+		    q->rq_timeout == MPI3MR_VD_IO_TIMEOUT * HZ) {
+			sdev_priv_data->vd_degraded_timeout =
+			    vd_degraded_io_timeout * HZ;
+			blk_queue_rq_timeout(q,
+			    sdev_priv_data->vd_degraded_timeout);
+		}
+		return;
+	}
+
+	if (!sdev_priv_data->vd_degraded_policy)
+		return;
+	sdev_priv_data->vd_degraded_policy = 0;
+	if (sdev_priv_data->vd_degraded_max_hw_sectors &&
+	    queue_max_hw_sectors(q) ==
+	    sdev_priv_data->vd_degraded_max_hw_sectors)
+		blk_queue_max_hw_sectors(q,
+		    sdev_priv_data->vd_saved_max_hw_sectors);
+	if (sdev_priv_data->vd_degraded_timeout &&
+	    q->rq_timeout == sdev_priv_data->vd_degraded_timeout)
+		blk_queue_rq_timeout(q, sdev_priv_data->vd_saved_timeout);
+}
+
+/**
+ * mpi3mr_vd_state_change - Track the state of a volume
+ * @mrioc: Adapter instance reference
+ * @tgtdev: Target device internal structure
+ * @state: Volume state reported in device page 0
+ *
+ * Account the time spent in the previous state and flag an
+ * exposed target for a queue depth and I/O policy refresh when
+ * the volume changes state.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_vd_state_change(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_tgt_dev *tgtdev, u8 state)
+{
+	struct tgt_dev_volume *vol_inf = &tgtdev->dev_spec.vol_inf;
+	unsigned long now = jiffies;
+
+	if (vol_inf->state_ts) {
+		if (vol_inf->state == state)
+			return;
+		if (vol_inf->state < MPI3MR_VD_STATE_COUNT)
+			vol_inf->state_time[vol_inf->state] +=
+			    jiffies_to_msecs(now - vol_inf->state_ts);
+		ioc_info(mrioc,
+		    "volume handle(0x%04x) state changed from %s to %s\n",
+		    tgtdev->dev_handle, mpi3mr_vd_state_name(vol_inf->state),
+		    mpi3mr_vd_state_name(state));
+		if (tgtdev->host_exposed)
+			tgtdev->qd_refresh = 1;
+	}
+
+	vol_inf->state = state;
+	vol_inf->state_ts = now ?: 1;
+}
+
+/**
+ * mpi3mr_update_sdev_qd - Apply target queue depth to a device
+ * @sdev: SCSI device reference
+ * @data: target device reference
+ *
+ * This is an iterator function called for each SCSI device in a
+ * target to apply the current queue depth of the target, any
+ * resulting change of the device queue depth is logged and
+ * counted.
+ *
+ * Return: Nothing.
+ */
+static void
+mpi3mr_update_sdev_qd(struct scsi_device *sdev, void *data)
+{
+	struct mpi3mr_tgt_dev *tgtdev = (struct mpi3mr_tgt_dev *)data;
+	int old_q_depth = sdev->queue_depth;
+
+	mpi3mr_change_queue_depth(sdev, mpi3mr_tgtdev_q_depth(tgtdev));
+	if (sdev->queue_depth == old_q_depth)
+		return;
+
+	tgtdev->qd_changes++;
+	sdev_printk(KERN_INFO, sdev,
+	    "queue depth changed from %d to %d (change %u)\n",
+	    old_q_depth, sdev->queue_depth, tgtdev->qd_changes);
+}
+
+/**
+ * mpi3mr_refresh_tgtdev_qd - Re-apply a changed target queue depth
+ * @mrioc: Adapter instance reference
+ * @tgtdev: Target device internal structure
+ *
+ * Apply the queue depth of the target device, and for volumes the
+ * volume state I/O policy, to its SCSI devices when the device
+ * page 0 data of an exposed target reported a new queue depth or
+ * volume state since it was last applied.  Devices not exposed
+ * yet get them in mpi3mr_slave_configure(), which clears the
+ * refresh flag, so that a queue depth set by the user is only
+ * overridden by an actual firmware change.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_refresh_tgtdev_qd(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_tgt_dev *tgtdev)
+{
+	if (!tgtdev->qd_refresh)
+		return;
+
+	tgtdev->qd_refresh = 0;
+	if (tgtdev->is_hidden || !tgtdev->host_exposed || !tgtdev->starget)
+		return;
+
+	starget_for_each_device(tgtdev->starget, (void *)tgtdev,
+	    mpi3mr_update_sdev_qd);
+	if (tgtdev->dev_type == MPI3_DEVICE_DEVFORM_VD)
+		starget_for_each_device(tgtdev->starget, (void *)tgtdev,
+		    mpi3mr_update_sdev_vd_policy);
+}
+
+/**
+ * mpi3mr_tgtdev_expose_pending - Check target device exposure
+ * @tgtdev: Target device
+ *
+ * Return: true when the target device has a valid device handle
+ * and is neither hidden nor exposed yet to the upper layers.
+ */
+static inline bool mpi3mr_tgtdev_expose_pending(struct mpi3mr_tgt_dev *tgtdev)
+{
+	return (tgtdev->dev_handle != MPI3MR_INVALID_DEV_HANDLE) &&
+	    !tgtdev->is_hidden && !tgtdev->host_exposed;
+}
+
+/**
+ * mpi3mr_expose_pending_tgtdevs - Expose unexposed target devices
+ * @mrioc: Adapter instance reference
+ *
+ * Expose all the target devices with a valid device handle
+ * which are neither hidden nor exposed yet to the upper layers
+ * in a single pass.  The pending target devices are collected
+ * with a reference under the tgtdev_lock and scanned after the
+ * lock is dropped, as the scan sleeps.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_expose_pending_tgtdevs(struct mpi3mr_ioc *mrioc)
+{
+	struct mpi3mr_tgt_dev *tgtdev, **pending;
+	unsigned long flags;
+	int i, count = 0, num_pending = 0;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	list_for_each_entry(tgtdev, &mrioc->tgtdev_list, list) {
+		if (mpi3mr_tgtdev_expose_pending(tgtdev))
+			count++;
+	}
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+	if (!count)
+		return;
+
+	pending = kcalloc(count, sizeof(*pending), GFP_KERNEL);
+	if (!pending) {
+		ioc_err(mrioc, "%s :failed to expose %d devices\n",
+		    __func__, count);
+		return;
+	}
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	list_for_each_entry(tgtdev, &mrioc->tgtdev_list, list) {
+		if (num_pending == count)
+			break;
+		if (mpi3mr_tgtdev_expose_pending(tgtdev)) {
+			mpi3mr_tgtdev_get(tgtdev);
+			pending[num_pending++] = tgtdev;
+		}
+	}
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+
+	for (i = 0; i < num_pending; i++) {
+		mpi3mr_report_tgtdev_to_host(mrioc, pending[i]->perst_id);
+		mpi3mr_tgtdev_put(pending[i]);
+	}
+	kfree(pending);
+}
+
+/**
+ * mpi3mr_rfresh_tgtdevs - Refresh target device exposure
+ * @mrioc: Adapter instance reference
+ *
+ * This is executed post controller reset to identify any
+ * missing devices during reset and remove from the upper layers,
+ * re-apply queue depths which changed across the reset or expose
+ * any newly detected device to the upper layers.
+ *
+ * Return: Nothing.
+ */
+
+void mpi3mr_rfresh_tgtdevs(struct mpi3mr_ioc *mrioc)
+{
+	struct mpi3mr_tgt_dev *tgtdev, *tgtdev_next;
 
 	list_for_each_entry_safe(tgtdev, tgtdev_next, &mrioc->tgtdev_list,
 	    list) {
@@ -778,12 +1594,37 @@ void mpi3mr_rfresh_tgtdevs(struct mpi3mr_ioc *mrioc)
 		}
 	}
 
-	tgtdev = NULL;
-	list_for_each_entry(tgtdev, &mrioc->tgtdev_list, list) {
-		if ((tgtdev->dev_handle != MPI3MR_INVALID_DEV_HANDLE) &&
-		    !tgtdev->is_hidden && !tgtdev->host_exposed)
-			mpi3mr_report_tgtdev_to_host(mrioc, tgtdev->perst_id);
+	list_for_each_entry(tgtdev, &mrioc->tgtdev_list, list)
+		mpi3mr_refresh_tgtdev_qd(mrioc, tgtdev);
+
+	mpi3mr_expose_pending_tgtdevs(mrioc);
+}
+
+/**
+ * mpi3mr_tgtdev_refresh_evt - Queue target device refresh
+ * @mrioc: Adapter instance reference
+ *
+ * Called at the end of a successful controller reset, the target
+ * devices are refreshed from the firmware event worker once the
+ * events posted by the firmware during the reset are processed.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_tgtdev_refresh_evt(struct mpi3mr_ioc *mrioc)
+{
+	struct mpi3mr_fwevt *fwevt;
+
+	fwevt = mpi3mr_alloc_fwevt(0);
+	if (!fwevt) {
+		ioc_info(mrioc, "%s :failure at %s:%d/%s()!\n",
+		    __func__, __FILE__, __LINE__, __func__);
+		return;
 	}
+	fwevt->mrioc = mrioc;
+	fwevt->event_id = MPI3MR_DRV_EVENT_TGT_REFRESH;
+	fwevt->send_ack = 0;
+	fwevt->process_evt = 1;
+	mpi3mr_fwevt_add_to_list(mrioc, fwevt);
 }
 
 /**
@@ -800,7 +1641,7 @@ void mpi3mr_rfresh_tgtdevs(struct mpi3mr_ioc *mrioc)
 static void mpi3mr_update_tgtdev(struct mpi3mr_ioc *mrioc,
 	struct mpi3mr_tgt_dev *tgtdev, struct mpi3_device_page0 *dev_pg0)
 {
-	u16 flags = 0;
+	u16 flags = 0, q_depth;
 	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data;
 	u8 prot_mask = 0;
 
@@ -810,7 +1651,12 @@ static void mpi3mr_update_tgtdev(struct mpi3mr_ioc *mrioc,
 	tgtdev->encl_handle = le16_to_cpu(dev_pg0->enclosure_handle);
 	tgtdev->parent_handle = le16_to_cpu(dev_pg0->parent_dev_handle);
 	tgtdev->slot = le16_to_cpu(dev_pg0->slot);
-	tgtdev->q_depth = le16_to_cpu(dev_pg0->queue_depth);
+	q_depth = le16_to_cpu(dev_pg0->queue_depth);
+	if (tgtdev->q_depth != q_depth) {
+		tgtdev->q_depth = q_depth;
+		if (tgtdev->host_exposed)
+			tgtdev->qd_refresh = 1;
+	}
 	tgtdev->wwid = le64_to_cpu(dev_pg0->wwid);
 
 	flags = le16_to_cpu(dev_pg0->flags);
@@ -820,7 +1666,7 @@ static void mpi3mr_update_tgtdev(struct mpi3mr_ioc *mrioc,
 		scsi_tgt_priv_data = (struct mpi3mr_stgt_priv_data *)
 		    tgtdev->starget->hostdata;
 		scsi_tgt_priv_data->perst_id = tgtdev->perst_id;
-		scsi_tgt_priv_data->dev_handle = tgtdev->dev_handle;
+		mpi3mr_set_tgt_handle(scsi_tgt_priv_data, tgtdev->dev_handle);
 		scsi_tgt_priv_data->dev_type = tgtdev->dev_type;
 	}
 
@@ -883,7 +1729,7 @@ static void mpi3mr_update_tgtdev(struct mpi3mr_ioc *mrioc,
 		struct mpi3_device0_vd_format *vdinf =
 		    &dev_pg0->device_specific.vd_format;
 
-		tgtdev->dev_spec.vol_inf.state = vdinf->vd_state;
+		mpi3mr_vd_state_change(mrioc, tgtdev, vdinf->vd_state);
 		if (vdinf->vd_state == MPI3_DEVICE0_VD_STATE_OFFLINE)
 			tgtdev->is_hidden = 1;
 		break;
@@ -937,6 +1783,8 @@ static void mpi3mr_devstatuschg_evt_bh(struct mpi3mr_ioc *mrioc,
 	tgtdev = mpi3mr_get_tgtdev_by_handle(mrioc, dev_handle);
 	if (!tgtdev)
 		goto out;
+	if (evtdata->reason_code == MPI3_EVENT_DEV_STAT_RC_HIDDEN)
+		tgtdev->is_hidden = 1;
 	if (uhide) {
 		tgtdev->is_hidden = 0;
 		if (!tgtdev->host_exposed)
@@ -990,6 +1838,7 @@ static void mpi3mr_devinfochg_evt_bh(struct mpi3mr_ioc *mrioc,
 	if (!tgtdev->is_hidden && tgtdev->host_exposed && tgtdev->starget)
 		starget_for_each_device(tgtdev->starget, (void *)tgtdev,
 		    mpi3mr_update_sdev);
+	mpi3mr_refresh_tgtdev_qd(mrioc, tgtdev);
 out:
 	if (tgtdev)
 		mpi3mr_tgtdev_put(tgtdev);
@@ -1074,6 +1923,75 @@ mpi3mr_sastopochg_evt_debug(struct mpi3mr_ioc *mrioc,
 	}
 }
 
+/**
+ * __mpi3mr_detach_expander_children - Detach devices of an expander
+ * @mrioc: Adapter instance reference
+ * @exp_handle: Expander device handle
+ * @removed_list: List to move the detached target devices to
+ *
+ * Move the target devices directly attached to the expander from
+ * the target device list to the tail of the removed list.  The
+ * caller must hold the tgtdev_lock.
+ *
+ * Return: Nothing.
+ */
+static void __mpi3mr_detach_expander_children(struct mpi3mr_ioc *mrioc,
+	u16 exp_handle, struct list_head *removed_list)
+{
+	struct mpi3mr_tgt_dev *tgtdev, *tgtdev_next;
+
+	list_for_each_entry_safe(tgtdev, tgtdev_next, &mrioc->tgtdev_list,
+	    list) {
+		if (tgtdev->parent_handle == exp_handle)
+			list_move_tail(&tgtdev->list, removed_list);
+	}
+}
+
+/**
+ * mpi3mr_remove_expander_subtree - Remove devices behind an expander
+ * @mrioc: Adapter instance reference
+ * @exp_handle: Expander device handle
+ *
+ * Detach all the target devices behind an expander which is gone
+ * from the target device list, including the ones attached through
+ * cascaded expanders, and then remove them from the upper layers.
+ * Each detached expander is visited in turn as the removed list
+ * grows, so the whole subtree is covered in a single locked pass.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_remove_expander_subtree(struct mpi3mr_ioc *mrioc,
+	u16 exp_handle)
+{
+	struct mpi3mr_tgt_dev *tgtdev, *tgtdev_next;
+	LIST_HEAD(removed_list);
+	unsigned long flags;
+	u32 count = 0;
+
+	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	__mpi3mr_detach_expander_children(mrioc, exp_handle, &removed_list);
+	list_for_each_entry(tgtdev, &removed_list, list) {
+		if (mpi3mr_tgtdev_is_expander(tgtdev) &&
+		    (tgtdev->dev_handle != exp_handle))
+			__mpi3mr_detach_expander_children(mrioc,
+			    tgtdev->dev_handle, &removed_list);
+	}
+	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+
+	list_for_each_entry_safe(tgtdev, tgtdev_next, &removed_list, list) {
+		if (tgtdev->host_exposed)
+			mpi3mr_remove_tgtdev_from_host(mrioc, tgtdev);
+		list_del_init(&tgtdev->list);
+		mpi3mr_tgtdev_put(tgtdev);
+		count++;
+	}
+
+	if (count)
+		ioc_info(mrioc,
+		    "%s :removed %u device(s) behind expander handle(0x%04x)\n",
+		    __func__, count, exp_handle);
+}
+
 /**
  * mpi3mr_sastopochg_evt_bh - SASTopologyChange evt bottomhalf
  * @mrioc: Adapter instance reference
@@ -1097,6 +2015,10 @@ static void mpi3mr_sastopochg_evt_bh(struct mpi3mr_ioc *mrioc,
 
 	mpi3mr_sastopochg_evt_debug(mrioc, event_data);
 
+	if (event_data->exp_status == MPI3_EVENT_SAS_TOPO_ES_NOT_RESPONDING)
+		mpi3mr_remove_expander_subtree(mrioc,
+		    le16_to_cpu(event_data->expander_dev_handle));
+
 	for (i = 0; i < event_data->num_entries; i++) {
 		handle = le16_to_cpu(event_data->phy_entry[i].attached_dev_handle);
 		if (!handle)
@@ -1255,50 +2177,456 @@ static void mpi3mr_pcietopochg_evt_bh(struct mpi3mr_ioc *mrioc,
 }
 
 /**
- * mpi3mr_fwevt_bh - Firmware event bottomhalf handler
- * @mrioc: Adapter instance reference
- * @fwevt: Firmware event reference
+ * mpi3mr_mark_lost_io_query - Mark LUNs with outstanding commands
+ * @rq: Block request
+ * @data: Adapter instance reference
+ * @reserved: Unused
  *
- * Identifies the firmware event and calls corresponding bottomg
- * half handler and sends event acknowledgment if required.
+ * Busy tag iterator callback marking the SAS/SATA LUNs which
+ * have commands outstanding in the driver for the lost command
+ * query.
  *
- * Return: Nothing.
+ * Return: true always.
  */
-static void mpi3mr_fwevt_bh(struct mpi3mr_ioc *mrioc,
-	struct mpi3mr_fwevt *fwevt)
+static bool mpi3mr_mark_lost_io_query(struct request *rq,
+	void *data, bool reserved)
 {
-	mrioc->current_event = fwevt;
-	mpi3mr_fwevt_del_from_list(mrioc, fwevt);
+	struct scsi_cmnd *scmd = blk_mq_rq_to_pdu(rq);
+	struct scmd_priv *priv = scsi_cmd_priv(scmd);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data;
 
-	if (mrioc->stop_drv_processing)
-		goto out;
+	if (!priv->in_lld_scope)
+		return true;
+	sdev_priv_data = scmd->device->hostdata;
+	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data ||
+	    (sdev_priv_data->tgt_priv_data->dev_type !=
+	    MPI3_DEVICE_DEVFORM_SAS_SATA))
+		return true;
+	sdev_priv_data->lost_io_query = 1;
+	return true;
+}
 
-	if (!fwevt->process_evt)
-		goto evt_ack;
+/**
+ * mpi3mr_lost_io_query_lun - Identify and abort lost commands of a LUN
+ * @mrioc: Adapter instance reference
+ * @sdev: SCSI device reference
+ * @seq_mark: Per operational queue sequence number place holder
+ * @queried: Number of commands queried
+ * @aborted: Number of lost commands aborted
+ *
+ * Query the task set of the LUN once.  When the LUN has no task
+ * at all, every command issued before the query and still
+ * outstanding is lost.  Otherwise the LUN is queried for a pending
+ * asynchronous event and only when it has one the individual
+ * commands issued before the query are queried.  The lost
+ * commands are aborted, so that they are returned to the SCSI
+ * midlayer for retry without waiting for the command timeout.
+ *
+ * The sequence number of a command is compared against the
+ * sequence numbers of its queue taken before the LUN was
+ * queried, so that a command posted after the query, or
+ * completed meanwhile and whose tag was reused by a new command,
+ * is not aborted.  The replies already posted to the queue are
+ * completed before a command is considered as lost, and at most
+ * MPI3MR_LOST_IO_MAX_QUERIES commands are queried per pass.
+ *
+ * Return: 0 to continue with the next LUN, non-zero when a task
+ * management request failed, a reset started or the query bound
+ * was reached.
+ */
+static int mpi3mr_lost_io_query_lun(struct mpi3mr_ioc *mrioc,
+	struct scsi_device *sdev, u32 *seq_mark, u32 *queried, u32 *aborted)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	struct mpi3mr_stgt_priv_data *stgt_priv_data;
+	struct op_req_qinfo *op_req_q;
+	struct scsi_cmnd *scmd;
+	struct scmd_priv *priv;
+	u16 qidx, host_tag, dev_handle;
+	unsigned long flags;
+	bool all_lost;
+	u32 seq;
+	u8 resp_code;
 
-	switch (fwevt->event_id) {
-	case MPI3_EVENT_DEVICE_ADDED:
-	{
-		struct mpi3_device_page0 *dev_pg0 =
-		    (struct mpi3_device_page0 *)fwevt->event_data;
-		mpi3mr_report_tgtdev_to_host(mrioc,
-		    le16_to_cpu(dev_pg0->persistent_id));
-		break;
-	}
-	case MPI3_EVENT_DEVICE_INFO_CHANGED:
-	{
-		mpi3mr_devinfochg_evt_bh(mrioc,
-		    (struct mpi3_device_page0 *)fwevt->event_data);
-		break;
+	stgt_priv_data = sdev_priv_data->tgt_priv_data;
+	dev_handle = stgt_priv_data->dev_handle;
+	if (stgt_priv_data->dev_removed ||
+	    (dev_handle == MPI3MR_INVALID_DEV_HANDLE))
+		return 0;
+
+	for (qidx = 0; qidx < mrioc->num_op_req_q; qidx++) {
+		op_req_q = &mrioc->req_qinfo[qidx];
+		spin_lock_irqsave(&op_req_q->q_lock, flags);
+		seq_mark[qidx] = op_req_q->io_seq;
+		spin_unlock_irqrestore(&op_req_q->q_lock, flags);
 	}
-	case MPI3_EVENT_DEVICE_STATUS_CHANGE:
-	{
-		mpi3mr_devstatuschg_evt_bh(mrioc, fwevt);
-		break;
+
+	resp_code = U8_MAX;
+	if (mpi3mr_issue_tm(mrioc, MPI3_SCSITASKMGMT_TASKTYPE_QUERY_TASK_SET,
+	    dev_handle, sdev_priv_data->lun_id, MPI3MR_HOSTTAG_BLK_TMS,
+	    MPI3MR_ABORTTM_TIMEOUT, &mrioc->host_tm_cmds, &resp_code, NULL))
+		return -1;
+	all_lost = (resp_code == MPI3MR_RSP_TM_COMPLETE);
+
+	if (!all_lost) {
+		resp_code = U8_MAX;
+		if (mpi3mr_issue_tm(mrioc,
+		    MPI3_SCSITASKMGMT_TASKTYPE_QUERY_ASYNC_EVENT, dev_handle,
+		    sdev_priv_data->lun_id, MPI3MR_HOSTTAG_BLK_TMS,
+		    MPI3MR_ABORTTM_TIMEOUT, &mrioc->host_tm_cmds, &resp_code,
+		    NULL))
+			return -1;
+		if (resp_code != MPI3MR_RSP_TM_SUCCEEDED)
+			return 0;
+	}
+
+	for (qidx = 0; qidx < mrioc->num_op_reply_q; qidx++) {
+		/* Complete the replies posted before the query reply */
+		mpi3mr_sync_op_reply_q(mrioc, qidx);
+		for (host_tag = 1; host_tag <= mrioc->max_host_ios;
+		    host_tag++) {
+			if (mrioc->reset_in_progress ||
+			    mrioc->stop_drv_processing)
+				return -1;
+			scmd = mpi3mr_scmd_from_host_tag(mrioc, host_tag, qidx);
+			if (!scmd || (scmd->device != sdev))
+				continue;
+			priv = scsi_cmd_priv(scmd);
+			seq = READ_ONCE(priv->seq);
+			/* Not posted yet or posted after the LUN was queried */
+			if (!seq || ((s32)(seq - seq_mark[qidx]) > 0))
+				continue;
+
+			if (!all_lost) {
+				if (*queried >= MPI3MR_LOST_IO_MAX_QUERIES)
+					return -1;
+				(*queried)++;
+				resp_code = U8_MAX;
+				if (mpi3mr_issue_tm(mrioc,
+				    MPI3_SCSITASKMGMT_TASKTYPE_QUERY_TASK,
+				    dev_handle, sdev_priv_data->lun_id,
+				    MPI3MR_HOSTTAG_BLK_TMS,
+				    MPI3MR_ABORTTM_TIMEOUT,
+				    &mrioc->host_tm_cmds, &resp_code, priv))
+					return -1;
+				if ((resp_code == MPI3MR_RSP_TM_SUCCEEDED) ||
+				    (resp_code == MPI3MR_RSP_IO_QUEUED_ON_IOC))
+					continue;
+				mpi3mr_sync_op_reply_q(mrioc, qidx);
+			}
+			/* The command may have completed and its tag reused */
+			if (!priv->in_lld_scope || (READ_ONCE(priv->seq) != seq))
+				continue;
+
+			sdev_printk(KERN_INFO, sdev,
+			    "Aborting lost command scmd(%p) handle(0x%04x)\n",
+			    scmd, dev_handle);
+			scsi_print_command(scmd);
+			if (mpi3mr_issue_tm(mrioc,
+			    MPI3_SCSITASKMGMT_TASKTYPE_ABORT_TASK, dev_handle,
+			    sdev_priv_data->lun_id, MPI3MR_HOSTTAG_BLK_TMS,
+			    MPI3MR_ABORTTM_TIMEOUT, &mrioc->host_tm_cmds,
+			    &resp_code, priv))
+				return -1;
+			(*aborted)++;
+		}
 	}
-	case MPI3_EVENT_SAS_TOPOLOGY_CHANGE_LIST:
-	{
-		mpi3mr_sastopochg_evt_bh(mrioc, fwevt);
+
+	return 0;
+}
+
+/**
+ * mpi3mr_query_lost_ios - Identify and abort lost SAS commands
+ * @mrioc: Adapter instance reference
+ *
+ * Check every SAS/SATA LUN with commands outstanding in the
+ * driver for lost commands, see mpi3mr_lost_io_query_lun().  The
+ * query is abandoned when a task management request fails or a
+ * controller reset starts, the reset recovers the commands.  It
+ * is also abandoned when the query bound is reached, the commands
+ * not queried are left to the command timeout.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_query_lost_ios(struct mpi3mr_ioc *mrioc)
+{
+	struct scsi_device *sdev;
+	struct mpi3mr_sdev_priv_data *sdev_priv_data;
+	u32 luns = 0, queried = 0, aborted = 0;
+	u32 *seq_mark;
+
+	seq_mark = kcalloc(mrioc->num_op_req_q, sizeof(*seq_mark),
+	    GFP_KERNEL);
+	if (!seq_mark)
+		return;
+
+	blk_mq_tagset_busy_iter(&mrioc->shost->tag_set,
+	    mpi3mr_mark_lost_io_query, (void *)mrioc);
+
+	shost_for_each_device(sdev, mrioc->shost) {
+		sdev_priv_data = sdev->hostdata;
+		if (!sdev_priv_data || !sdev_priv_data->lost_io_query)
+			continue;
+		sdev_priv_data->lost_io_query = 0;
+		if (mrioc->reset_in_progress || mrioc->stop_drv_processing ||
+		    mpi3mr_lost_io_query_lun(mrioc, sdev, seq_mark, &queried,
+		    &aborted)) {
+			scsi_device_put(sdev);
+			break;
+		}
+		luns++;
+	}
+
+	/* Clear the marks left by an abandoned query */
+	shost_for_each_device(sdev, mrioc->shost) {
+		sdev_priv_data = sdev->hostdata;
+		if (sdev_priv_data)
+			sdev_priv_data->lost_io_query = 0;
+	}
+
+	kfree(seq_mark);
+	if (queried >= MPI3MR_LOST_IO_MAX_QUERIES)
+		ioc_warn(mrioc, "%s :query bound of %u commands reached\n",
+		    __func__, queried);
+	ioc_info(mrioc,
+	    "%s :queried %u LUN(s) and %u command(s), aborted %u lost command(s)\n",
+	    __func__, luns, queried, aborted);
+}
+
+/**
+ * mpi3mr_lost_io_work - Lost command query work
+ * @work: Work struct embedded in the adapter instance
+ *
+ * Query the outstanding commands for lost commands once for all
+ * the SAS broadcast primitives received before the query started
+ * and repeat it if more were received while querying.  The query
+ * runs outside of the ordered firmware event worker, so that the
+ * task management requests it issues do not delay the topology
+ * events.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_lost_io_work(struct work_struct *work)
+{
+	struct mpi3mr_ioc *mrioc =
+	    container_of(work, struct mpi3mr_ioc, lost_io_work);
+
+	do {
+		atomic_set(&mrioc->bcast_pending, 1);
+		mpi3mr_query_lost_ios(mrioc);
+	} while (atomic_dec_if_positive(&mrioc->bcast_pending) > 0);
+}
+
+/**
+ * mpi3mr_discovery_evt_bh - Discovery/enumeration evt bottomhalf
+ * @mrioc: Adapter instance reference
+ * @fwevt: Firmware event reference
+ *
+ * Track the SAS discovery and PCIe enumeration state per IO
+ * unit port.  The target devices added while either of them is
+ * in progress on any port are not exposed individually, they
+ * are exposed together to the upper layers once all ports have
+ * completed.  The watchdog exposes them anyway if no progress is
+ * reported for MPI3MR_DISCOVERY_TIMEOUT seconds.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_discovery_evt_bh(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_fwevt *fwevt)
+{
+	struct mpi3_event_data_sas_discovery *disc_evt =
+	    (struct mpi3_event_data_sas_discovery *)fwevt->event_data;
+	struct mpi3_event_data_pcie_enumeration *enum_evt =
+	    (struct mpi3_event_data_pcie_enumeration *)fwevt->event_data;
+	unsigned long *ports;
+	u8 in_progress, port;
+	u32 status;
+
+	if (fwevt->event_id == MPI3_EVENT_SAS_DISCOVERY) {
+		ports = mrioc->sas_disc_ports;
+		port = disc_evt->io_unit_port;
+		in_progress = (disc_evt->reason_code ==
+		    MPI3_EVENT_SAS_DISC_RC_STARTED);
+		status = le32_to_cpu(disc_evt->discovery_status);
+	} else {
+		ports = mrioc->pcie_enum_ports;
+		port = enum_evt->io_unit_port;
+		in_progress = (enum_evt->reason_code ==
+		    MPI3_EVENT_PCIE_ENUM_RC_STARTED);
+		status = le32_to_cpu(enum_evt->enumeration_status);
+	}
+
+	if (in_progress == test_bit(port, ports))
+		return;
+	if (in_progress)
+		set_bit(port, ports);
+	else
+		clear_bit(port, ports);
+	mrioc->disc_timeout_counter = 0;
+
+	ioc_info(mrioc, "%s :%s %s on port(%d)\n", __func__,
+	    (ports == mrioc->sas_disc_ports) ? "SAS discovery" :
+	    "PCIe enumeration", in_progress ? "started" : "completed", port);
+	if (!in_progress && status)
+		ioc_warn(mrioc, "%s :%s status(0x%08x) on port(%d)\n",
+		    __func__, (ports == mrioc->sas_disc_ports) ?
+		    "SAS discovery" : "PCIe enumeration", status, port);
+
+	if (!mpi3mr_discovery_pending(mrioc))
+		mpi3mr_expose_pending_tgtdevs(mrioc);
+}
+
+/**
+ * mpi3mr_discovery_timeout_bh - Discovery timeout bottomhalf
+ * @mrioc: Adapter instance reference
+ *
+ * Stop waiting for the SAS discovery and PCIe enumeration
+ * completions which were not reported and expose the target
+ * devices held back for them.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_discovery_timeout_bh(struct mpi3mr_ioc *mrioc)
+{
+	if (!mpi3mr_discovery_pending(mrioc))
+		return;
+
+	ioc_warn(mrioc,
+	    "%s :discovery made no progress in %d seconds, exposing pending devices\n",
+	    __func__, MPI3MR_DISCOVERY_TIMEOUT);
+	bitmap_zero(mrioc->sas_disc_ports, MPI3MR_NUM_IOU_PORTS);
+	bitmap_zero(mrioc->pcie_enum_ports, MPI3MR_NUM_IOU_PORTS);
+	mrioc->disc_timeout_counter = 0;
+	mpi3mr_expose_pending_tgtdevs(mrioc);
+}
+
+/**
+ * mpi3mr_discovery_timeout - Queue discovery timeout handling
+ * @mrioc: Adapter instance reference
+ *
+ * Called from the watchdog when a SAS discovery or PCIe
+ * enumeration made no progress for MPI3MR_DISCOVERY_TIMEOUT
+ * seconds.  The held back target devices are exposed from the
+ * firmware event worker, serialized with the topology events.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_discovery_timeout(struct mpi3mr_ioc *mrioc)
+{
+	struct mpi3mr_fwevt *fwevt;
+
+	fwevt = mpi3mr_alloc_fwevt(0);
+	if (!fwevt) {
+		ioc_info(mrioc, "%s :failure at %s:%d/%s()!\n",
+		    __func__, __FILE__, __LINE__, __func__);
+		return;
+	}
+	fwevt->mrioc = mrioc;
+	fwevt->event_id = MPI3MR_DRV_EVENT_DISC_TIMEOUT;
+	fwevt->send_ack = 0;
+	fwevt->process_evt = 1;
+	mpi3mr_fwevt_add_to_list(mrioc, fwevt);
+}
+
+/**
+ * mpi3mr_prepare_for_reset_evt_bh - Reset announcement bottomhalf
+ * @mrioc: Adapter instance reference
+ * @fwevt: Firmware event reference
+ *
+ * The firmware announces a controller reset with the prepare for
+ * reset event.  Stop issuing new I/O so that the commands
+ * outstanding drain while the firmware prepares for the reset and
+ * fewer of them are flushed and retried.  The event is
+ * acknowledged right away: this runs on the ordered event worker
+ * and must not wait for the drain, the watchdog ends the quiesce
+ * if the reset does not follow in time.  An aborted announcement
+ * resumes I/O immediately.  Nothing is quiesced while a controller
+ * reset holds the reset mutex, the reset already stopped the I/O.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_prepare_for_reset_evt_bh(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_fwevt *fwevt)
+{
+	struct mpi3_event_data_prepare_for_reset *evtdata =
+	    (struct mpi3_event_data_prepare_for_reset *)fwevt->event_data;
+
+	if (evtdata->reason_code == MPI3_EVENT_PREPARE_RESET_RC_ABORT) {
+		mpi3mr_prepare_for_reset_end(mrioc);
+		return;
+	}
+
+	if (!mutex_trylock(&mrioc->reset_mutex))
+		return;
+
+	if (!mrioc->prepare_for_reset && !mrioc->reset_in_progress) {
+		ioc_info(mrioc,
+		    "quiescing I/O for announced controller reset\n");
+		mrioc->prepare_for_reset = 1;
+		mrioc->prepare_for_reset_timeout_counter = 0;
+		mpi3mr_update_host_io_state(mrioc);
+		mpi3mr_block_host_io(mrioc);
+	}
+	mutex_unlock(&mrioc->reset_mutex);
+}
+
+/**
+ * mpi3mr_fwevt_bh - Firmware event bottomhalf handler
+ * @mrioc: Adapter instance reference
+ * @fwevt: Firmware event reference
+ *
+ * Identifies the firmware event and calls corresponding bottomg
+ * half handler and sends event acknowledgment if required.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_fwevt_bh(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_fwevt *fwevt)
+{
+	mrioc->current_event = fwevt;
+	mpi3mr_fwevt_del_from_list(mrioc, fwevt);
+
+	if (mrioc->stop_drv_processing)
+		goto out;
+
+	if (!fwevt->process_evt)
+		goto evt_ack;
+
+	switch (fwevt->event_id) {
+	case MPI3_EVENT_DEVICE_ADDED:
+	{
+		struct mpi3_device_page0 *dev_pg0 =
+		    (struct mpi3_device_page0 *)fwevt->event_data;
+		if (mpi3mr_create_tgtdev(mrioc, dev_pg0)) {
+			ioc_err(mrioc,
+			    "%s :Failed to add device in the device add event\n",
+			    __func__);
+			break;
+		}
+		/*
+		 * Devices added during discovery or enumeration are
+		 * exposed together once it is completed
+		 */
+		if (mpi3mr_discovery_pending(mrioc))
+			break;
+		mpi3mr_report_tgtdev_to_host(mrioc,
+		    le16_to_cpu(dev_pg0->persistent_id));
+		break;
+	}
+	case MPI3_EVENT_DEVICE_INFO_CHANGED:
+	{
+		mpi3mr_devinfochg_evt_bh(mrioc,
+		    (struct mpi3_device_page0 *)fwevt->event_data);
+		break;
+	}
+	case MPI3_EVENT_DEVICE_STATUS_CHANGE:
+	{
+		mpi3mr_devstatuschg_evt_bh(mrioc, fwevt);
+		break;
+	}
+	case MPI3_EVENT_SAS_TOPOLOGY_CHANGE_LIST:
+	{
+		mpi3mr_sastopochg_evt_bh(mrioc, fwevt);
 		break;
 	}
 	case MPI3_EVENT_PCIE_TOPOLOGY_CHANGE_LIST:
@@ -1306,6 +2634,27 @@ static void mpi3mr_fwevt_bh(struct mpi3mr_ioc *mrioc,
 		mpi3mr_pcietopochg_evt_bh(mrioc, fwevt);
 		break;
 	}
+	case MPI3MR_DRV_EVENT_TGT_REFRESH:
+	{
+		mpi3mr_rfresh_tgtdevs(mrioc);
+		break;
+	}
+	case MPI3_EVENT_SAS_DISCOVERY:
+	case MPI3_EVENT_PCIE_ENUMERATION:
+	{
+		mpi3mr_discovery_evt_bh(mrioc, fwevt);
+		break;
+	}
+	case MPI3MR_DRV_EVENT_DISC_TIMEOUT:
+	{
+		mpi3mr_discovery_timeout_bh(mrioc);
+		break;
+	}
+	case MPI3_EVENT_PREPARE_FOR_RESET:
+	{
+		mpi3mr_prepare_for_reset_evt_bh(mrioc, fwevt);
+		break;
+	}
 	default:
 		break;
 	}
@@ -1637,6 +2986,9 @@ static void mpi3mr_pcietopochg_evt_th(struct mpi3mr_ioc *mrioc,
 		if (!handle)
 			continue;
 		reason_code = topo_evt->port_entry[i].port_status;
+		if (reason_code == MPI3_EVENT_PCIE_TOPO_PS_PORT_CHANGED ||
+		    reason_code == MPI3_EVENT_PCIE_TOPO_PS_NO_CHANGE)
+			continue;
 		scsi_tgt_priv_data =  NULL;
 		tgtdev = mpi3mr_get_tgtdev_by_handle(mrioc, handle);
 		if (tgtdev && tgtdev->starget && tgtdev->starget->hostdata)
@@ -1646,8 +2998,11 @@ static void mpi3mr_pcietopochg_evt_th(struct mpi3mr_ioc *mrioc,
 		case MPI3_EVENT_PCIE_TOPO_PS_NOT_RESPONDING:
 			if (scsi_tgt_priv_data) {
 				scsi_tgt_priv_data->dev_removed = 1;
+				set_bit(MPI3MR_TGT_IO_REMOVED,
+				    &scsi_tgt_priv_data->io_state);
 				scsi_tgt_priv_data->dev_removedelay = 0;
-				atomic_set(&scsi_tgt_priv_data->block_io, 0);
+				mpi3mr_release_tgt_io(mrioc,
+				    scsi_tgt_priv_data);
 			}
 			mpi3mr_dev_rmhs_send_tm(mrioc, handle, NULL,
 			    MPI3_CTRL_OP_REMOVE_DEVICE);
@@ -1655,15 +3010,15 @@ static void mpi3mr_pcietopochg_evt_th(struct mpi3mr_ioc *mrioc,
 		case MPI3_EVENT_PCIE_TOPO_PS_DELAY_NOT_RESPONDING:
 			if (scsi_tgt_priv_data) {
 				scsi_tgt_priv_data->dev_removedelay = 1;
-				atomic_inc(&scsi_tgt_priv_data->block_io);
+				mpi3mr_block_tgt_io(mrioc, scsi_tgt_priv_data);
 			}
 			break;
 		case MPI3_EVENT_PCIE_TOPO_PS_RESPONDING:
 			if (scsi_tgt_priv_data &&
 			    scsi_tgt_priv_data->dev_removedelay) {
 				scsi_tgt_priv_data->dev_removedelay = 0;
-				atomic_dec_if_positive
-				    (&scsi_tgt_priv_data->block_io);
+				mpi3mr_unblock_tgt_io(mrioc,
+				    scsi_tgt_priv_data);
 			}
 			break;
 		case MPI3_EVENT_PCIE_TOPO_PS_PORT_CHANGED:
@@ -1675,6 +3030,69 @@ static void mpi3mr_pcietopochg_evt_th(struct mpi3mr_ioc *mrioc,
 	}
 }
 
+/**
+ * __mpi3mr_block_expander_subtree - Block I/O behind an expander
+ * @mrioc: Adapter instance reference
+ * @exp_handle: Expander device handle
+ * @exp_status: Expander status from the topology change event
+ * @depth: Cascade level of the expander below the event expander
+ *
+ * Update the I/O state of all the target devices attached to the
+ * expander and, recursively, to the expanders cascaded below it:
+ * block it when the expander is delayed not responding, unblock
+ * it when the expander responds again and mark the devices
+ * removed when the expander is gone.  Only the block references
+ * and state bits are updated here, the request queues are quiesced
+ * from the block work of each target.  The caller must hold the
+ * tgtdev_lock.
+ *
+ * Return: Nothing.
+ */
+static void __mpi3mr_block_expander_subtree(struct mpi3mr_ioc *mrioc,
+	u16 exp_handle, u8 exp_status, u8 depth)
+{
+	struct mpi3mr_tgt_dev *tgtdev;
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data;
+
+	list_for_each_entry(tgtdev, &mrioc->tgtdev_list, list) {
+		if (tgtdev->parent_handle != exp_handle)
+			continue;
+		if (mpi3mr_tgtdev_is_expander(tgtdev)) {
+			if ((depth < MPI3MR_MAX_EXP_CASCADE) &&
+			    (tgtdev->dev_handle != exp_handle))
+				__mpi3mr_block_expander_subtree(mrioc,
+				    tgtdev->dev_handle, exp_status, depth + 1);
+			continue;
+		}
+		if (!tgtdev->starget || !tgtdev->starget->hostdata)
+			continue;
+		scsi_tgt_priv_data = tgtdev->starget->hostdata;
+		switch (exp_status) {
+		case MPI3_EVENT_SAS_TOPO_ES_NOT_RESPONDING:
+			scsi_tgt_priv_data->dev_removed = 1;
+			set_bit(MPI3MR_TGT_IO_REMOVED,
+			    &scsi_tgt_priv_data->io_state);
+			scsi_tgt_priv_data->dev_removedelay = 0;
+			__mpi3mr_release_tgt_io(scsi_tgt_priv_data);
+			break;
+		case MPI3_EVENT_SAS_TOPO_ES_DELAY_NOT_RESPONDING:
+			if (scsi_tgt_priv_data->dev_removedelay)
+				break;
+			scsi_tgt_priv_data->dev_removedelay = 1;
+			__mpi3mr_block_tgt_io(scsi_tgt_priv_data);
+			break;
+		case MPI3_EVENT_SAS_TOPO_ES_RESPONDING:
+			if (!scsi_tgt_priv_data->dev_removedelay)
+				break;
+			scsi_tgt_priv_data->dev_removedelay = 0;
+			__mpi3mr_unblock_tgt_io(scsi_tgt_priv_data);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 /**
  * mpi3mr_sastopochg_evt_th - SASTopologyChange evt tophalf
  * @mrioc: Adapter instance reference
@@ -1693,17 +3111,30 @@ static void mpi3mr_sastopochg_evt_th(struct mpi3mr_ioc *mrioc,
 	struct mpi3_event_data_sas_topology_change_list *topo_evt =
 	    (struct mpi3_event_data_sas_topology_change_list *)event_reply->event_data;
 	int i;
-	u16 handle;
+	u16 handle, exp_handle;
 	u8 reason_code;
+	unsigned long flags;
 	struct mpi3mr_tgt_dev *tgtdev = NULL;
 	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data = NULL;
 
+	exp_handle = le16_to_cpu(topo_evt->expander_dev_handle);
+	if (exp_handle &&
+	    (topo_evt->exp_status != MPI3_EVENT_SAS_TOPO_ES_NO_EXPANDER)) {
+		spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+		__mpi3mr_block_expander_subtree(mrioc, exp_handle,
+		    topo_evt->exp_status, 0);
+		spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
+	}
+
 	for (i = 0; i < topo_evt->num_entries; i++) {
 		handle = le16_to_cpu(topo_evt->phy_entry[i].attached_dev_handle);
 		if (!handle)
 			continue;
 		reason_code = topo_evt->phy_entry[i].status &
 		    MPI3_EVENT_SAS_TOPO_PHY_RC_MASK;
+		if (reason_code == MPI3_EVENT_SAS_TOPO_PHY_RC_PHY_CHANGED ||
+		    reason_code == MPI3_EVENT_SAS_TOPO_PHY_RC_NO_CHANGE)
+			continue;
 		scsi_tgt_priv_data =  NULL;
 		tgtdev = mpi3mr_get_tgtdev_by_handle(mrioc, handle);
 		if (tgtdev && tgtdev->starget && tgtdev->starget->hostdata)
@@ -1713,24 +3144,28 @@ static void mpi3mr_sastopochg_evt_th(struct mpi3mr_ioc *mrioc,
 		case MPI3_EVENT_SAS_TOPO_PHY_RC_TARG_NOT_RESPONDING:
 			if (scsi_tgt_priv_data) {
 				scsi_tgt_priv_data->dev_removed = 1;
+				set_bit(MPI3MR_TGT_IO_REMOVED,
+				    &scsi_tgt_priv_data->io_state);
 				scsi_tgt_priv_data->dev_removedelay = 0;
-				atomic_set(&scsi_tgt_priv_data->block_io, 0);
+				mpi3mr_release_tgt_io(mrioc,
+				    scsi_tgt_priv_data);
 			}
 			mpi3mr_dev_rmhs_send_tm(mrioc, handle, NULL,
 			    MPI3_CTRL_OP_REMOVE_DEVICE);
 			break;
 		case MPI3_EVENT_SAS_TOPO_PHY_RC_DELAY_NOT_RESPONDING:
-			if (scsi_tgt_priv_data) {
+			if (scsi_tgt_priv_data &&
+			    !scsi_tgt_priv_data->dev_removedelay) {
 				scsi_tgt_priv_data->dev_removedelay = 1;
-				atomic_inc(&scsi_tgt_priv_data->block_io);
+				mpi3mr_block_tgt_io(mrioc, scsi_tgt_priv_data);
 			}
 			break;
 		case MPI3_EVENT_SAS_TOPO_PHY_RC_RESPONDING:
 			if (scsi_tgt_priv_data &&
 			    scsi_tgt_priv_data->dev_removedelay) {
 				scsi_tgt_priv_data->dev_removedelay = 0;
-				atomic_dec_if_positive
-				    (&scsi_tgt_priv_data->block_io);
+				mpi3mr_unblock_tgt_io(mrioc,
+				    scsi_tgt_priv_data);
 			}
 		case MPI3_EVENT_SAS_TOPO_PHY_RC_PHY_CHANGED:
 		default:
@@ -1789,20 +3224,31 @@ static void mpi3mr_devstatuschg_evt_th(struct mpi3mr_ioc *mrioc,
 		break;
 	}
 
-	tgtdev = mpi3mr_get_tgtdev_by_handle(mrioc, dev_handle);
-	if (!tgtdev)
+	if (!(block || ublock || delete))
 		goto out;
-	if (hide)
+
+	/*
+	 * The target device may not be created yet when its device added
+	 * event is still pending in the bottom half, the removal and
+	 * hidden handshakes are issued regardless.
+	 */
+	tgtdev = mpi3mr_get_tgtdev_by_handle(mrioc, dev_handle);
+	if (tgtdev && hide)
 		tgtdev->is_hidden = hide;
-	if (tgtdev->starget && tgtdev->starget->hostdata) {
+	if (tgtdev && tgtdev->starget && tgtdev->starget->hostdata) {
 		scsi_tgt_priv_data = (struct mpi3mr_stgt_priv_data *)
 		    tgtdev->starget->hostdata;
-		if (block)
-			atomic_inc(&scsi_tgt_priv_data->block_io);
-		if (delete)
+		if (block &&
+		    mpi3mr_int_reset_start(mrioc, scsi_tgt_priv_data))
+			mpi3mr_block_tgt_io(mrioc, scsi_tgt_priv_data);
+		if (delete) {
 			scsi_tgt_priv_data->dev_removed = 1;
-		if (ublock)
-			atomic_dec_if_positive(&scsi_tgt_priv_data->block_io);
+			set_bit(MPI3MR_TGT_IO_REMOVED,
+			    &scsi_tgt_priv_data->io_state);
+		}
+		if (ublock &&
+		    mpi3mr_int_reset_end(mrioc, scsi_tgt_priv_data))
+			mpi3mr_unblock_tgt_io(mrioc, scsi_tgt_priv_data);
 	}
 	if (remove)
 		mpi3mr_dev_rmhs_send_tm(mrioc, dev_handle, NULL,
@@ -1816,6 +3262,37 @@ out:
 		mpi3mr_tgtdev_put(tgtdev);
 }
 
+/**
+ * mpi3mr_sasbcast_evt_th - SAS broadcast primitive evt tophalf
+ * @mrioc: Adapter instance reference
+ * @event_reply: event data
+ *
+ * Identifies the broadcast primitives which may indicate lost
+ * commands and queues the lost command query, coalescing them
+ * with the ones whose query is already pending.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_sasbcast_evt_th(struct mpi3mr_ioc *mrioc,
+	struct mpi3_event_notification_reply *event_reply)
+{
+	struct mpi3_event_data_sas_broadcast_primitive *evtdata =
+	    (struct mpi3_event_data_sas_broadcast_primitive *)
+	    event_reply->event_data;
+
+	switch (evtdata->primitive) {
+	case MPI3_EVENT_BROADCAST_PRIMITIVE_CHANGE:
+	case MPI3_EVENT_BROADCAST_PRIMITIVE_SES:
+	case MPI3_EVENT_BROADCAST_PRIMITIVE_ASYNCHRONOUS_EVENT:
+		break;
+	default:
+		return;
+	}
+
+	if (atomic_inc_return(&mrioc->bcast_pending) == 1)
+		queue_work(system_long_wq, &mrioc->lost_io_work);
+}
+
 /**
  * mpi3mr_energypackchg_evt_th - Energy pack change evt tophalf
  * @mrioc: Adapter instance reference
@@ -1875,14 +3352,8 @@ void mpi3mr_os_handle_events(struct mpi3mr_ioc *mrioc,
 	switch (evt_type) {
 	case MPI3_EVENT_DEVICE_ADDED:
 	{
-		struct mpi3_device_page0 *dev_pg0 =
-		    (struct mpi3_device_page0 *)event_reply->event_data;
-		if (mpi3mr_create_tgtdev(mrioc, dev_pg0))
-			ioc_err(mrioc,
-			    "%s :Failed to add device in the device add event\n",
-			    __func__);
-		else
-			process_evt_bh = 1;
+		/* Target device is created in the bottom half */
+		process_evt_bh = 1;
 		break;
 	}
 	case MPI3_EVENT_DEVICE_STATUS_CHANGE:
@@ -1913,13 +3384,22 @@ void mpi3mr_os_handle_events(struct mpi3mr_ioc *mrioc,
 		mpi3mr_energypackchg_evt_th(mrioc, event_reply);
 		break;
 	}
-	case MPI3_EVENT_ENCL_DEVICE_STATUS_CHANGE:
 	case MPI3_EVENT_SAS_DISCOVERY:
-	case MPI3_EVENT_CABLE_MGMT:
-	case MPI3_EVENT_SAS_DEVICE_DISCOVERY_ERROR:
-	case MPI3_EVENT_SAS_BROADCAST_PRIMITIVE:
 	case MPI3_EVENT_PCIE_ENUMERATION:
+	{
+		process_evt_bh = 1;
+		break;
+	}
+	case MPI3_EVENT_SAS_BROADCAST_PRIMITIVE:
+	{
+		mpi3mr_sasbcast_evt_th(mrioc, event_reply);
+		break;
+	}
+	case MPI3_EVENT_PREPARE_FOR_RESET:
+	{
+		process_evt_bh = 1;
 		break;
+	}
 	default:
 		ioc_info(mrioc, "%s :event 0x%02x is not handled\n",
 		    __func__, evt_type);
@@ -2132,24 +3612,130 @@ static void mpi3mr_map_eedp_error(struct scsi_cmnd *scmd,
 }
 
 /**
- * mpi3mr_process_op_reply_desc - reply descriptor handler
+ * mpi3mr_host_requeue - Requeue commands failed transiently
  * @mrioc: Adapter instance reference
- * @reply_desc: Operational reply descriptor
- * @reply_dma: place holder for reply DMA address
- * @qidx: Operational queue index
- *
- * Process the operational reply descriptor and identifies the
- * descriptor type. Based on the descriptor map the MPI3 request
- * status to a SCSI command status and calls scsi_done call
- * back.
- *
- * Return: Nothing
+ * @scmd: SCSI command reference
+ * @ioc_status: IOC status of the completion
+ * @scsi_status: SCSI status of the completion
+ * @scsi_state: SCSI state of the completion
+ * @xfer_count: Transferred data length
+ * @sense_count: Sense data length
+ *
+ * Identify the completions which report a controller side
+ * condition and no device status: commands terminated by the
+ * controller, by a task management request or by a reset, and
+ * successful or residual mismatch completions without any SCSI
+ * status and, for the latter, without any data transferred.  A
+ * completion carrying valid sense data or a SCSI status other
+ * than GOOD is never requeued, the device reported it.  Such
+ * commands are returned with DID_REQUEUE so that the midlayer
+ * reissues them after the device queue backoff, without error
+ * handling and without consuming the command's retries.  The
+ * number of requeues per command is bounded, after which the
+ * regular error mapping applies, except for commands terminated
+ * while the firmware resets the device internally; those wait on
+ * the quiesced request queue and are issued again as soon as the
+ * reset completes.  Fail fast requests and commands to removed
+ * devices are never requeued.
+ *
+ * Return: true if the command is to be requeued, else false.
  */
-void mpi3mr_process_op_reply_desc(struct mpi3mr_ioc *mrioc,
-	struct mpi3_default_reply_descriptor *reply_desc, u64 *reply_dma, u16 qidx)
+static bool mpi3mr_host_requeue(struct mpi3mr_ioc *mrioc,
+	struct scsi_cmnd *scmd, u16 ioc_status, u8 scsi_status, u8 scsi_state,
+	u32 xfer_count, u32 sense_count)
 {
-	u16 reply_desc_type, host_tag = 0;
-	u16 ioc_status = MPI3_IOCSTATUS_SUCCESS;
+	struct scmd_priv *priv = scsi_cmd_priv(scmd);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = scmd->device->hostdata;
+	bool int_reset;
+
+	if (sense_count && ((scsi_state & MPI3_SCSI_STATE_SENSE_MASK) ==
+	    MPI3_SCSI_STATE_SENSE_VALID))
+		return false;
+	if (scsi_status != MPI3_SCSI_STATUS_GOOD)
+		return false;
+
+	switch (ioc_status) {
+	case MPI3_IOCSTATUS_SCSI_IOC_TERMINATED:
+	case MPI3_IOCSTATUS_SCSI_TASK_TERMINATED:
+	case MPI3_IOCSTATUS_SCSI_EXT_TERMINATED:
+		break;
+	case MPI3_IOCSTATUS_SCSI_RESIDUAL_MISMATCH:
+		if (xfer_count ||
+		    !(scsi_state & MPI3_SCSI_STATE_NO_SCSI_STATUS))
+			return false;
+		break;
+	case MPI3_IOCSTATUS_SUCCESS:
+		if (!(scsi_state & MPI3_SCSI_STATE_NO_SCSI_STATUS) ||
+		    !(scsi_state & MPI3_SCSI_STATE_TERMINATED))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	if (!scmd->allowed || blk_noretry_request(scmd->request))
+		return false;
+	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data ||
+	    sdev_priv_data->tgt_priv_data->dev_removed)
+		return false;
+	int_reset = READ_ONCE(sdev_priv_data->tgt_priv_data->int_reset_ts);
+	if (!int_reset) {
+		if (priv->host_retries >= MPI3MR_HOST_RETRY_MAX)
+			return false;
+		priv->host_retries++;
+	}
+
+	atomic64_inc(&mrioc->host_requeues);
+	return true;
+}
+
+/**
+ * mpi3mr_sense_expected - Check for a routine check condition
+ * @sshdr: Decoded sense data
+ *
+ * Unit attentions, which include thin provisioning soft threshold
+ * reports, recovered errors such as the ones reported by media
+ * scans and check conditions without a sense key are routine and
+ * handled by the midlayer.
+ *
+ * Return: true if the check condition is expected, else false.
+ */
+static bool mpi3mr_sense_expected(struct scsi_sense_hdr *sshdr)
+{
+	switch (sshdr->sense_key) {
+	case NO_SENSE:
+	case RECOVERED_ERROR:
+	case UNIT_ATTENTION:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * mpi3mr_process_op_reply_desc - reply descriptor handler
+ * @mrioc: Adapter instance reference
+ * @reply_desc: Operational reply descriptor
+ * @reply_dma: place holder for reply DMA address
+ * @sense_dma: place holder for sense buffer DMA address
+ * @qidx: Operational queue index
+ *
+ * Process the operational reply descriptor and identifies the
+ * descriptor type. Based on the descriptor map the MPI3 request
+ * status to a SCSI command status and calls scsi_done call
+ * back.  The reply frame and sense buffer are returned to the
+ * caller for reposting.  The sense key of check conditions is
+ * counted, routine check conditions are completed without
+ * logging.
+ *
+ * Return: Nothing
+ */
+void mpi3mr_process_op_reply_desc(struct mpi3mr_ioc *mrioc,
+	struct mpi3_default_reply_descriptor *reply_desc, u64 *reply_dma,
+	u64 *sense_dma, u16 qidx)
+{
+	u16 reply_desc_type, host_tag = 0;
+	u16 ioc_status = MPI3_IOCSTATUS_SUCCESS;
 	u32 ioc_loginfo = 0;
 	struct mpi3_status_reply_descriptor *status_desc = NULL;
 	struct mpi3_address_reply_descriptor *addr_desc = NULL;
@@ -2162,8 +3748,11 @@ void mpi3mr_process_op_reply_desc(struct mpi3mr_ioc *mrioc,
 	u32 xfer_count = 0, sense_count = 0, resp_data = 0;
 	u16 dev_handle = 0xFFFF;
 	struct scsi_sense_hdr sshdr;
+	struct op_reply_qinfo *op_reply_q;
+	bool sense_expected = false;
 
 	*reply_dma = 0;
+	*sense_dma = 0;
 	reply_desc_type = le16_to_cpu(reply_desc->reply_flags) &
 	    MPI3_REPLY_DESCRIPT_FLAGS_TYPE_MASK;
 	switch (reply_desc_type) {
@@ -2233,6 +3822,11 @@ void mpi3mr_process_op_reply_desc(struct mpi3mr_ioc *mrioc,
 		u32 sz = min_t(u32, SCSI_SENSE_BUFFERSIZE, sense_count);
 
 		memcpy(scmd->sense_buffer, sense_buf, sz);
+		if (scsi_normalize_sense(scmd->sense_buffer, sz, &sshdr)) {
+			op_reply_q = mrioc->op_reply_qinfo + qidx;
+			op_reply_q->sense_keys[sshdr.sense_key]++;
+			sense_expected = mpi3mr_sense_expected(&sshdr);
+		}
 	}
 
 	switch (ioc_status) {
@@ -2303,6 +3897,16 @@ void mpi3mr_process_op_reply_desc(struct mpi3mr_ioc *mrioc,
 		break;
 	}
 
+	if (mpi3mr_host_requeue(mrioc, scmd, ioc_status, scsi_status,
+	    scsi_state, xfer_count, sense_count)) {
+		scmd->result = DID_REQUEUE << 16;
+		goto out_success;
+	}
+
+	if (sense_expected &&
+	    scmd->result == ((DID_OK << 16) | SAM_STAT_CHECK_CONDITION))
+		goto out_success;
+
 	if (scmd->result != (DID_OK << 16) && (scmd->cmnd[0] != ATA_12) &&
 	    (scmd->cmnd[0] != ATA_16)) {
 		ioc_info(mrioc, "%s :scmd->result 0x%x\n", __func__,
@@ -2333,8 +3937,7 @@ out_success:
 	scmd->scsi_done(scmd);
 out:
 	if (sense_buf)
-		mpi3mr_repost_sense_buf(mrioc,
-		    le64_to_cpu(scsi_reply->sense_data_buffer_address));
+		*sense_dma = le64_to_cpu(scsi_reply->sense_data_buffer_address);
 }
 
 /**
@@ -2448,6 +4051,13 @@ static int mpi3mr_prepare_sg_scmd(struct mpi3mr_ioc *mrioc,
 		/* Reserve 1st segment (scsiio_req->sgl[0]) for eedp */
 	}
 
+	/* Single segment always fits in the main message frame */
+	if (sges_left == 1) {
+		mpi3mr_add_sg_single(sg_local, simple_sgl_flags_last,
+		    sg_dma_len(sg_scmd), sg_dma_address(sg_scmd));
+		return 0;
+	}
+
 	if (scsiio_req->msg_flags ==
 	    MPI3_SCSIIO_MSGFLAGS_METASGL_VALID && !meta_sg) {
 		sges_in_segment--;
@@ -2490,18 +4100,16 @@ static int mpi3mr_prepare_sg_scmd(struct mpi3mr_ioc *mrioc,
 	sg_local = chain;
 
 fill_in_last_segment:
-	while (sges_left > 0) {
-		if (sges_left == 1)
-			mpi3mr_add_sg_single(sg_local,
-			    simple_sgl_flags_last, sg_dma_len(sg_scmd),
-			    sg_dma_address(sg_scmd));
-		else
-			mpi3mr_add_sg_single(sg_local, simple_sgl_flags,
-			    sg_dma_len(sg_scmd), sg_dma_address(sg_scmd));
+	while (sges_left > 1) {
+		mpi3mr_add_sg_single(sg_local, simple_sgl_flags,
+		    sg_dma_len(sg_scmd), sg_dma_address(sg_scmd));
 		sg_scmd = sg_next(sg_scmd);
 		sg_local += sizeof(struct mpi3_sge_common);
 		sges_left--;
 	}
+	if (sges_left)
+		mpi3mr_add_sg_single(sg_local, simple_sgl_flags_last,
+		    sg_dma_len(sg_scmd), sg_dma_address(sg_scmd));
 
 	return 0;
 }
@@ -2583,6 +4191,130 @@ static void mpi3mr_print_response_code(struct mpi3mr_ioc *mrioc, u8 resp_code)
 	    resp_code, desc);
 }
 
+/**
+ * mpi3mr_tgtdev_io_timeout - Default I/O timeout of a device
+ * @tgtdev: Target device internal structure
+ *
+ * RAID volumes get a longer timeout to ride through the volume
+ * state transitions handled by the controller firmware and NVMe
+ * devices a shorter one, so that a hung drive is recovered in
+ * seconds rather than on hard drive scale timers.
+ *
+ * Return: I/O timeout in seconds.
+ */
+static u32 mpi3mr_tgtdev_io_timeout(struct mpi3mr_tgt_dev *tgtdev)
+{
+	switch (tgtdev->dev_type) {
+	case MPI3_DEVICE_DEVFORM_PCIE:
+		return MPI3MR_NVME_IO_TIMEOUT;
+	case MPI3_DEVICE_DEVFORM_VD:
+		return MPI3MR_VD_IO_TIMEOUT;
+	default:
+		return MPI3MR_SAS_SATA_IO_TIMEOUT;
+	}
+}
+
+/**
+ * mpi3mr_tgtdev_tm_timeout - Task management timeout of a device
+ * @tgtdev: Target device internal structure
+ * @abort: Abort or query task TM if true, reset TM if false
+ * @def_timeout: Timeout requested by the caller in seconds
+ *
+ * The timeout set through sysfs takes precedence, followed by
+ * the timeout reported by NVMe devices in device page 0 and
+ * finally the timeout requested by the caller.
+ *
+ * Return: TM timeout in seconds.
+ */
+static ulong mpi3mr_tgtdev_tm_timeout(struct mpi3mr_tgt_dev *tgtdev,
+	bool abort, ulong def_timeout)
+{
+	u8 user_to = abort ? tgtdev->abort_to : tgtdev->reset_to;
+	u8 dev_to = 0;
+
+	if (user_to)
+		return user_to;
+	if (tgtdev->dev_type == MPI3_DEVICE_DEVFORM_PCIE)
+		dev_to = abort ? tgtdev->dev_spec.pcie_inf.abort_to :
+		    tgtdev->dev_spec.pcie_inf.reset_to;
+
+	return dev_to ? dev_to : def_timeout;
+}
+
+/**
+ * mpi3mr_reply_q_has_tgt_io - Check reply queue carries target I/O
+ * @scsi_tgt_priv_data: SCSI target private data or NULL
+ * @qidx: Operational reply queue index
+ *
+ * Check whether any command addressed to the target is in driver
+ * scope on the given queue pair.  Without target private data
+ * the target I/O is unknown and assumed to be on the queue.
+ *
+ * Return: true if the target may have I/O on the queue, else
+ * false.
+ */
+static bool mpi3mr_reply_q_has_tgt_io(
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data, u16 qidx)
+{
+	if (!scsi_tgt_priv_data ||
+	    (qidx >= scsi_tgt_priv_data->num_q_io_pend))
+		return true;
+
+	return atomic_read(&scsi_tgt_priv_data->q_io_pend[qidx]) != 0;
+}
+
+/**
+ * mpi3mr_sync_tm_reply_queues - Flush replies terminated by a TM
+ * @mrioc: Adapter instance reference
+ * @scsi_tgt_priv_data: Private data of the target the TM was
+ * issued to or NULL
+ * @qidx: Queue index of the aborted command or U16_MAX
+ *
+ * The replies of the commands terminated by a TM are posted
+ * before the TM reply.  Flush the reply queues which may hold
+ * them, before the commands are considered as completed: the
+ * queue of the aborted command for an abort, and for a reset
+ * the busy queues either carrying I/O to the target or being
+ * processed at the moment.  The target I/O is checked first as
+ * a completion in progress is no longer seen as outstanding.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_sync_tm_reply_queues(struct mpi3mr_ioc *mrioc,
+	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data, u16 qidx)
+{
+	struct op_reply_qinfo *op_reply_q;
+	u16 i;
+
+	if (qidx != U16_MAX) {
+		mpi3mr_sync_op_reply_q(mrioc, qidx);
+		return;
+	}
+
+	for (i = 0; i < mrioc->num_op_reply_q; i++) {
+		op_reply_q = mrioc->op_reply_qinfo + i;
+		if (!atomic_read(&op_reply_q->pend_ios))
+			continue;
+		if (mpi3mr_reply_q_has_tgt_io(scsi_tgt_priv_data, i) ||
+		    atomic_read(&op_reply_q->in_use))
+			mpi3mr_sync_op_reply_q(mrioc, i);
+	}
+}
+
+/**
+ * mpi3mr_tm_is_query - Check for a query task management type
+ * @tm_type: Task Management type
+ *
+ * Return: true when the task management request only queries
+ * the device and does not terminate any command.
+ */
+static inline bool mpi3mr_tm_is_query(u8 tm_type)
+{
+	return (tm_type == MPI3_SCSITASKMGMT_TASKTYPE_QUERY_TASK) ||
+	    (tm_type == MPI3_SCSITASKMGMT_TASKTYPE_QUERY_TASK_SET) ||
+	    (tm_type == MPI3_SCSITASKMGMT_TASKTYPE_QUERY_ASYNC_EVENT);
+}
+
 /**
  * mpi3mr_issue_tm - Issue Task Management request
  * @mrioc: Adapter instance reference
@@ -2612,6 +4344,7 @@ static int mpi3mr_issue_tm(struct mpi3mr_ioc *mrioc, u8 tm_type,
 	struct mpi3mr_tgt_dev *tgtdev = NULL;
 	struct mpi3mr_stgt_priv_data *scsi_tgt_priv_data = NULL;
 	struct op_req_qinfo *op_req_q = NULL;
+	u16 tm_qidx = U16_MAX;
 
 	ioc_info(mrioc, "%s :Issue TM: TM type (0x%x) for devhandle 0x%04x\n",
 	     __func__, tm_type, handle);
@@ -2651,19 +4384,19 @@ static int mpi3mr_issue_tm(struct mpi3mr_ioc *mrioc, u8 tm_type,
 	if (tgtdev && tgtdev->starget && tgtdev->starget->hostdata) {
 		scsi_tgt_priv_data = (struct mpi3mr_stgt_priv_data *)
 		    tgtdev->starget->hostdata;
-		atomic_inc(&scsi_tgt_priv_data->block_io);
+		/* A query terminates nothing, the target I/O keeps flowing */
+		if (!mpi3mr_tm_is_query(tm_type))
+			mpi3mr_block_tgt_io(mrioc, scsi_tgt_priv_data);
 	}
 	if (cmd_priv) {
-		op_req_q = &mrioc->req_qinfo[cmd_priv->req_q_idx];
+		tm_qidx = cmd_priv->req_q_idx;
+		op_req_q = &mrioc->req_qinfo[tm_qidx];
 		tm_req.task_host_tag = cpu_to_le16(cmd_priv->host_tag);
 		tm_req.task_request_queue_id = cpu_to_le16(op_req_q->qid);
 	}
-	if (tgtdev && (tgtdev->dev_type == MPI3_DEVICE_DEVFORM_PCIE)) {
-		if (cmd_priv && tgtdev->dev_spec.pcie_inf.abort_to)
-			timeout = tgtdev->dev_spec.pcie_inf.abort_to;
-		else if (!cmd_priv && tgtdev->dev_spec.pcie_inf.reset_to)
-			timeout = tgtdev->dev_spec.pcie_inf.reset_to;
-	}
+	if (tgtdev)
+		timeout = mpi3mr_tgtdev_tm_timeout(tgtdev, cmd_priv != NULL,
+		    timeout);
 
 	init_completion(&drv_cmd->done);
 	retval = mpi3mr_admin_request_post(mrioc, &tm_req, sizeof(tm_req), 1);
@@ -2707,7 +4440,7 @@ static int mpi3mr_issue_tm(struct mpi3mr_ioc *mrioc, u8 tm_type,
 	case MPI3MR_RSP_TM_COMPLETE:
 		break;
 	case MPI3MR_RSP_IO_QUEUED_ON_IOC:
-		if (tm_type != MPI3_SCSITASKMGMT_TASKTYPE_QUERY_TASK)
+		if (!mpi3mr_tm_is_query(tm_type))
 			retval = -1;
 		break;
 	default:
@@ -2727,18 +4460,13 @@ static int mpi3mr_issue_tm(struct mpi3mr_ioc *mrioc, u8 tm_type,
 out_unlock:
 	drv_cmd->state = MPI3MR_CMD_NOTUSED;
 	mutex_unlock(&drv_cmd->mutex);
-	if (scsi_tgt_priv_data)
-		atomic_dec_if_positive(&scsi_tgt_priv_data->block_io);
+	if (scsi_tgt_priv_data && !mpi3mr_tm_is_query(tm_type))
+		mpi3mr_unblock_tgt_io(mrioc, scsi_tgt_priv_data);
+	if (!retval && !mpi3mr_tm_is_query(tm_type))
+		mpi3mr_sync_tm_reply_queues(mrioc, scsi_tgt_priv_data,
+		    tm_qidx);
 	if (tgtdev)
 		mpi3mr_tgtdev_put(tgtdev);
-	if (!retval) {
-		/*
-		 * Flush all IRQ handlers by calling synchronize_irq().
-		 * mpi3mr_ioc_disable_intr() takes care of it.
-		 */
-		mpi3mr_ioc_disable_intr(mrioc);
-		mpi3mr_ioc_enable_intr(mrioc);
-	}
 out:
 	return retval;
 }
@@ -2874,6 +4602,35 @@ void mpi3mr_wait_for_host_io(struct mpi3mr_ioc *mrioc, u32 timeout)
 	    mpi3mr_get_fw_pending_ios(mrioc));
 }
 
+/**
+ * mpi3mr_eh_timed_out - SCSI command timeout callback
+ * @scmd: SCSI command reference
+ *
+ * The firmware completes or terminates the commands outstanding
+ * to a device once its internal device reset is over, restart
+ * the timers of such commands instead of escalating to error
+ * handling, for up to MPI3MR_INT_RESET_MAX_TIMEOUT seconds from
+ * the start of the internal reset.
+ *
+ * Return: BLK_EH_RESET_TIMER to restart the timer, else
+ * BLK_EH_DONE.
+ */
+static enum blk_eh_timer_return mpi3mr_eh_timed_out(struct scsi_cmnd *scmd)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = scmd->device->hostdata;
+	unsigned long int_reset_ts;
+
+	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data)
+		return BLK_EH_DONE;
+
+	int_reset_ts = READ_ONCE(sdev_priv_data->tgt_priv_data->int_reset_ts);
+	if (!int_reset_ts || time_after(jiffies,
+	    int_reset_ts + MPI3MR_INT_RESET_MAX_TIMEOUT * HZ))
+		return BLK_EH_DONE;
+
+	return BLK_EH_RESET_TIMER;
+}
+
 /**
  * mpi3mr_eh_host_reset - Host reset error handling callback
  * @scmd: SCSI command reference
@@ -3084,6 +4841,7 @@ static int mpi3mr_scan_finished(struct Scsi_Host *shost,
 		    __func__, mrioc->scan_failed);
 		mrioc->is_driver_loading = 0;
 		mrioc->stop_drv_processing = 1;
+		mpi3mr_update_host_io_state(mrioc);
 		return 1;
 	}
 
@@ -3157,6 +4915,7 @@ static void mpi3mr_target_destroy(struct scsi_target *starget)
 	shost = dev_to_shost(&starget->dev);
 	mrioc = shost_priv(shost);
 	scsi_tgt_priv_data = starget->hostdata;
+	cancel_delayed_work_sync(&scsi_tgt_priv_data->int_reset_work);
 
 	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
 	tgt_dev = __mpi3mr_get_tgtdev_from_tgtpriv(mrioc, scsi_tgt_priv_data);
@@ -3171,16 +4930,71 @@ static void mpi3mr_target_destroy(struct scsi_target *starget)
 	}
 	spin_unlock_irqrestore(&mrioc->tgtdev_lock, flags);
 
+	/* The event top halves can no longer reach the target */
+	cancel_work_sync(&scsi_tgt_priv_data->io_block_work);
+	kfree(scsi_tgt_priv_data->q_io_pend);
 	kfree(starget->hostdata);
 	starget->hostdata = NULL;
 }
 
+/**
+ * mpi3mr_read_actuator_ranges - Read concurrent positioning ranges
+ * @mrioc: Adapter instance reference
+ * @sdev: SCSI device reference
+ *
+ * Read the concurrent positioning ranges VPD page of multi
+ * actuator drives and cache the LBA range served by each
+ * actuator in the SCSI device private data.
+ *
+ * Return: Nothing.
+ */
+static void mpi3mr_read_actuator_ranges(struct mpi3mr_ioc *mrioc,
+	struct scsi_device *sdev)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	unsigned char *buf, *desc;
+	int buf_len, vpd_len, i, nr_ranges;
+
+	sdev_priv_data->num_actuators = 0;
+	if (!scsi_device_supports_vpd(sdev))
+		return;
+
+	buf_len = MPI3MR_VPD_CPR_HDR_LEN +
+	    (MPI3MR_MAX_ACTUATOR_RANGES * MPI3MR_VPD_CPR_DESC_LEN);
+	buf = kzalloc(buf_len, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	if (scsi_get_vpd_page(sdev, MPI3MR_VPD_CPR_PAGE, buf, buf_len))
+		goto out;
+
+	vpd_len = min_t(int, get_unaligned_be16(&buf[2]) + 4, buf_len);
+	if (vpd_len < MPI3MR_VPD_CPR_HDR_LEN + MPI3MR_VPD_CPR_DESC_LEN)
+		goto out;
+	nr_ranges = (vpd_len - MPI3MR_VPD_CPR_HDR_LEN) /
+	    MPI3MR_VPD_CPR_DESC_LEN;
+
+	desc = &buf[MPI3MR_VPD_CPR_HDR_LEN];
+	for (i = 0; i < nr_ranges; i++, desc += MPI3MR_VPD_CPR_DESC_LEN) {
+		sdev_priv_data->actuator_range[i].start_lba =
+		    get_unaligned_be64(&desc[8]);
+		sdev_priv_data->actuator_range[i].num_lbas =
+		    get_unaligned_be64(&desc[16]);
+	}
+	sdev_priv_data->num_actuators = nr_ranges;
+	sdev_printk(KERN_INFO, sdev, "%d concurrent positioning range(s)\n",
+	    nr_ranges);
+out:
+	kfree(buf);
+}
+
 /**
  * mpi3mr_slave_configure - Slave configure callback handler
  * @sdev: SCSI device reference
  *
- * Configure queue depth, max hardware sectors and virt boundary
- * as required
+ * Configure queue depth, I/O timeout, max hardware sectors and
+ * virt boundary as required and read the actuator ranges of
+ * SAS/SATA devices
  *
  * Return: 0 always.
  */
@@ -3203,7 +5017,10 @@ static int mpi3mr_slave_configure(struct scsi_device *sdev)
 	if (!tgt_dev)
 		return -ENXIO;
 
-	mpi3mr_change_queue_depth(sdev, tgt_dev->q_depth);
+	mpi3mr_change_queue_depth(sdev, mpi3mr_tgtdev_q_depth(tgt_dev));
+	tgt_dev->qd_refresh = 0;
+	blk_queue_rq_timeout(sdev->request_queue,
+	    mpi3mr_tgtdev_io_timeout(tgt_dev) * HZ);
 	switch (tgt_dev->dev_type) {
 	case MPI3_DEVICE_DEVFORM_PCIE:
 		/*The block layer hw sector size = 512*/
@@ -3212,6 +5029,12 @@ static int mpi3mr_slave_configure(struct scsi_device *sdev)
 		blk_queue_virt_boundary(sdev->request_queue,
 		    ((1 << tgt_dev->dev_spec.pcie_inf.pgsz) - 1));
 		break;
+	case MPI3_DEVICE_DEVFORM_SAS_SATA:
+		mpi3mr_read_actuator_ranges(mrioc, sdev);
+		break;
+	case MPI3_DEVICE_DEVFORM_VD:
+		mpi3mr_update_sdev_vd_policy(sdev, tgt_dev);
+		break;
 	default:
 		break;
 	}
@@ -3249,8 +5072,11 @@ static int mpi3mr_slave_alloc(struct scsi_device *sdev)
 	tgt_dev = __mpi3mr_get_tgtdev_by_perst_id(mrioc, starget->id);
 
 	if (tgt_dev) {
-		if (tgt_dev->starget == NULL)
+		if (tgt_dev->starget == NULL) {
 			tgt_dev->starget = starget;
+			/* Host state changes skipped the unlinked target */
+			mpi3mr_set_tgt_host_state(mrioc, scsi_tgt_priv_data);
+		}
 		mpi3mr_tgtdev_put(tgt_dev);
 		retval = 0;
 	} else {
@@ -3293,17 +5119,29 @@ static int mpi3mr_target_alloc(struct scsi_target *starget)
 	scsi_tgt_priv_data = kzalloc(sizeof(*scsi_tgt_priv_data), GFP_KERNEL);
 	if (!scsi_tgt_priv_data)
 		return -ENOMEM;
+	scsi_tgt_priv_data->q_io_pend = kcalloc(mrioc->num_op_reply_q,
+	    sizeof(*scsi_tgt_priv_data->q_io_pend), GFP_KERNEL);
+	if (!scsi_tgt_priv_data->q_io_pend) {
+		kfree(scsi_tgt_priv_data);
+		return -ENOMEM;
+	}
+	scsi_tgt_priv_data->num_q_io_pend = mrioc->num_op_reply_q;
 
 	starget->hostdata = scsi_tgt_priv_data;
 	scsi_tgt_priv_data->starget = starget;
-	scsi_tgt_priv_data->dev_handle = MPI3MR_INVALID_DEV_HANDLE;
+	INIT_WORK(&scsi_tgt_priv_data->io_block_work,
+	    mpi3mr_tgt_io_block_work);
+	INIT_DELAYED_WORK(&scsi_tgt_priv_data->int_reset_work,
+	    mpi3mr_int_reset_timeout_work);
+	mpi3mr_set_tgt_handle(scsi_tgt_priv_data, MPI3MR_INVALID_DEV_HANDLE);
 
 	spin_lock_irqsave(&mrioc->tgtdev_lock, flags);
+	mpi3mr_set_tgt_host_state(mrioc, scsi_tgt_priv_data);
 	tgt_dev = __mpi3mr_get_tgtdev_by_perst_id(mrioc, starget->id);
 	if (tgt_dev && !tgt_dev->is_hidden) {
 		starget->hostdata = scsi_tgt_priv_data;
 		scsi_tgt_priv_data->starget = starget;
-		scsi_tgt_priv_data->dev_handle = tgt_dev->dev_handle;
+		mpi3mr_set_tgt_handle(scsi_tgt_priv_data, tgt_dev->dev_handle);
 		scsi_tgt_priv_data->perst_id = tgt_dev->perst_id;
 		scsi_tgt_priv_data->dev_type = tgt_dev->dev_type;
 		scsi_tgt_priv_data->tgt_dev = tgt_dev;
@@ -3311,6 +5149,7 @@ static int mpi3mr_target_alloc(struct scsi_target *starget)
 		atomic_set(&scsi_tgt_priv_data->block_io, 0);
 		retval = 0;
 	} else {
+		kfree(scsi_tgt_priv_data->q_io_pend);
 		kfree(scsi_tgt_priv_data);
 		retval = -ENXIO;
 	}
@@ -3434,6 +5273,91 @@ inline bool mpi3mr_allow_scmd_to_fw(struct scsi_cmnd *scmd)
 	}
 }
 
+/**
+ * mpi3mr_count_active_luns - Sample the LUNs with I/O outstanding
+ * @mrioc: Adapter instance reference
+ *
+ * Count the LUNs with commands outstanding for the fair share of
+ * the controller I/O budget.  Called from the watchdog, so the
+ * dispatch path reads a count at most one watchdog interval old
+ * instead of tracking every LUN turning active or idle.
+ *
+ * Return: Nothing.
+ */
+void mpi3mr_count_active_luns(struct mpi3mr_ioc *mrioc)
+{
+	struct scsi_device *sdev;
+	u32 active = 0;
+
+	shost_for_each_device(sdev, mrioc->shost) {
+		if (atomic_read(&sdev->device_busy))
+			active++;
+	}
+	WRITE_ONCE(mrioc->io_active_luns, active);
+}
+
+/**
+ * mpi3mr_io_budget_check - Controller I/O budget admission
+ * @mrioc: Adapter instance reference
+ * @sdev: SCSI device the command is addressed to
+ *
+ * Share the outstanding I/O budget of the controller between the
+ * LUNs with I/O outstanding.  Each active LUN is entitled to an
+ * equal share of the host tags and never less than
+ * MPI3MR_IO_SHARE_MIN.  While the controller has headroom left a
+ * LUN may borrow the shares of idle LUNs; once the headroom is
+ * used up a LUN at or above its share is turned away so that
+ * only its request queue backs off.
+ *
+ * The LUN outstanding count is the midlayer device busy count,
+ * which already includes the command being dispatched, and the
+ * controller outstanding count is summed from the operational
+ * reply queues only on the over share path, so the dispatch path
+ * writes no shared counter.
+ *
+ * A throttled LUN cannot starve: it is turned away only while it
+ * has commands of its own outstanding.  Each of those completes
+ * or is timed out and the completion makes the midlayer rerun
+ * the device queue.
+ *
+ * The borrowed and throttled counters are bumped only on the
+ * over share paths and are reported by the io_share_stats device
+ * attribute.
+ *
+ * Return: true if the command may be issued, else false.
+ */
+static bool mpi3mr_io_budget_check(struct mpi3mr_ioc *mrioc,
+	struct scsi_device *sdev)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	int active, share, limit, outstanding, used = 0;
+	u16 i;
+
+	active = READ_ONCE(mrioc->io_active_luns);
+	if (active <= 1)
+		return true;
+
+	outstanding = atomic_read(&sdev->device_busy) - 1;
+	if (outstanding <= 0)
+		return true;
+
+	share = max_t(int, mrioc->max_host_ios / active, MPI3MR_IO_SHARE_MIN);
+	if (outstanding < share)
+		return true;
+
+	limit = mrioc->max_host_ios -
+	    mrioc->max_host_ios / MPI3MR_IO_BUDGET_HEADROOM;
+	for (i = 0; i < mrioc->num_op_reply_q; i++)
+		used += atomic_read(&mrioc->op_reply_qinfo[i].pend_ios);
+	if (used < limit) {
+		atomic64_inc(&sdev_priv_data->io_borrowed);
+		return true;
+	}
+
+	atomic64_inc(&sdev_priv_data->io_throttled);
+	return false;
+}
+
 /**
  * mpi3mr_qcmd - I/O request despatcher
  * @shost: SCSI Host reference
@@ -3461,6 +5385,7 @@ static int mpi3mr_qcmd(struct Scsi_Host *shost,
 	u32 scsiio_flags = 0;
 	struct request *rq = scmd->request;
 	int iprio_class;
+	unsigned long io_state;
 
 	sdev_priv_data = scmd->device->hostdata;
 	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data) {
@@ -3469,47 +5394,62 @@ static int mpi3mr_qcmd(struct Scsi_Host *shost,
 		goto out;
 	}
 
-	if (mrioc->stop_drv_processing &&
-	    !(mpi3mr_allow_scmd_to_fw(scmd))) {
-		scmd->result = DID_NO_CONNECT << 16;
-		scmd->scsi_done(scmd);
-		goto out;
-	}
-
-	if (mrioc->reset_in_progress) {
-		retval = SCSI_MLQUEUE_HOST_BUSY;
-		goto out;
-	}
-
 	stgt_priv_data = sdev_priv_data->tgt_priv_data;
 
-	dev_handle = stgt_priv_data->dev_handle;
-	if (dev_handle == MPI3MR_INVALID_DEV_HANDLE) {
-		scmd->result = DID_NO_CONNECT << 16;
-		scmd->scsi_done(scmd);
-		goto out;
-	}
-	if (stgt_priv_data->dev_removed) {
-		scmd->result = DID_NO_CONNECT << 16;
-		scmd->scsi_done(scmd);
-		goto out;
-	}
+	/*
+	 * The controller and target conditions which prevent issuing
+	 * the command are all mirrored in the target I/O state, check
+	 * them individually only when any of them is set.
+	 */
+	io_state = READ_ONCE(stgt_priv_data->io_state);
+	if (unlikely(io_state)) {
+		if (test_bit(MPI3MR_TGT_IO_HOST_STOP, &io_state) &&
+		    !(mpi3mr_allow_scmd_to_fw(scmd))) {
+			scmd->result = DID_NO_CONNECT << 16;
+			scmd->scsi_done(scmd);
+			goto out;
+		}
+
+		if (test_bit(MPI3MR_TGT_IO_HOST_RESET, &io_state)) {
+			retval = SCSI_MLQUEUE_HOST_BUSY;
+			goto out;
+		}
 
-	if (atomic_read(&stgt_priv_data->block_io)) {
-		if (mrioc->stop_drv_processing) {
+		if (test_bit(MPI3MR_TGT_IO_NO_HANDLE, &io_state) ||
+		    test_bit(MPI3MR_TGT_IO_REMOVED, &io_state)) {
 			scmd->result = DID_NO_CONNECT << 16;
 			scmd->scsi_done(scmd);
 			goto out;
 		}
-		retval = SCSI_MLQUEUE_DEVICE_BUSY;
-		goto out;
+
+		/*
+		 * Request queues are quiesced while I/O to the target is
+		 * blocked, this only catches commands dispatched before
+		 * the quiesce.
+		 */
+		if (test_bit(MPI3MR_TGT_IO_BLOCKED, &io_state)) {
+			if (test_bit(MPI3MR_TGT_IO_HOST_STOP, &io_state)) {
+				scmd->result = DID_NO_CONNECT << 16;
+				scmd->scsi_done(scmd);
+				goto out;
+			}
+			retval = SCSI_MLQUEUE_DEVICE_BUSY;
+			goto out;
+		}
 	}
 
+	dev_handle = stgt_priv_data->dev_handle;
+
 	if ((scmd->cmnd[0] == UNMAP) &&
 	    (stgt_priv_data->dev_type == MPI3_DEVICE_DEVFORM_PCIE) &&
 	    mpi3mr_check_return_unmap(mrioc, scmd))
 		goto out;
 
+	if (!mpi3mr_io_budget_check(mrioc, scmd->device)) {
+		retval = SCSI_MLQUEUE_DEVICE_BUSY;
+		goto out;
+	}
+
 	host_tag = mpi3mr_host_tag_for_scmd(mrioc, scmd);
 	if (host_tag == MPI3MR_HOSTTAG_INVALID) {
 		scmd->result = DID_ERROR << 16;
@@ -3558,7 +5498,7 @@ static int mpi3mr_qcmd(struct Scsi_Host *shost,
 	op_req_q = &mrioc->req_qinfo[scmd_priv_data->req_q_idx];
 
 	if (mpi3mr_op_request_post(mrioc, op_req_q,
-	    scmd_priv_data->mpi3mr_scsiio_req)) {
+	    scmd_priv_data->mpi3mr_scsiio_req, &scmd_priv_data->seq)) {
 		mpi3mr_clear_scmd_priv(mrioc, scmd);
 		retval = SCSI_MLQUEUE_HOST_BUSY;
 		goto out;
@@ -3568,6 +5508,525 @@ out:
 	return retval;
 }
 
+/**
+ * reset_history_show - Controller reset history display
+ * @dev: class device
+ * @attr: Device attributes
+ * @buf: Buffer to copy
+ *
+ * A sysfs 'read-only' shost attribute to display the retained
+ * controller reset records with per phase recovery timing.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+reset_history_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(dev);
+	struct mpi3mr_ioc *mrioc = shost_priv(shost);
+
+	return mpi3mr_print_reset_history(mrioc, buf, PAGE_SIZE);
+}
+static DEVICE_ATTR_RO(reset_history);
+
+/**
+ * reply_queue_stats_show - Operational reply queue statistics
+ * @dev: class device
+ * @attr: Device attributes
+ * @buf: Buffer to copy
+ *
+ * A sysfs 'read-only' shost attribute to display, per operational
+ * reply queue, the outstanding I/O count, the largest number of
+ * reply descriptors drained in one pass, the number of passes which
+ * published the consumer index before the end of the pass, the
+ * total consumer index publications and those triggered by the
+ * fill watermark. Only whole lines are printed, when the page is
+ * full the last line gives the number of queues left out.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+reply_queue_stats_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(dev);
+	struct mpi3mr_ioc *mrioc = shost_priv(shost);
+	struct op_reply_qinfo *op_reply_q;
+	char line[MPI3MR_STATS_LINE_SZ];
+	ssize_t len = 0;
+	int n;
+	u16 i;
+
+	for (i = 0; i < mrioc->num_op_reply_q; i++) {
+		op_reply_q = mrioc->op_reply_qinfo + i;
+		n = scnprintf(line, sizeof(line),
+		    "qid=%u depth=%u pend_ios=%d max_drain=%u deep_drains=%u ci_updates=%llu wmark_updates=%llu\n",
+		    i + 1, op_reply_q->num_replies,
+		    atomic_read(&op_reply_q->pend_ios),
+		    op_reply_q->max_drain, op_reply_q->deep_drains,
+		    op_reply_q->ci_updates, op_reply_q->wmark_updates);
+		if (len + n > PAGE_SIZE - MPI3MR_STATS_LINE_SZ) {
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+			    "truncated=%u\n", mrioc->num_op_reply_q - i);
+			break;
+		}
+		memcpy(buf + len, line, n);
+		len += n;
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(reply_queue_stats);
+
+/**
+ * sense_key_stats_show - Check condition sense key statistics
+ * @dev: class device
+ * @attr: Device attributes
+ * @buf: Buffer to copy
+ *
+ * A sysfs 'read-only' shost attribute to display, per sense key,
+ * the number of check conditions completed by the controller.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+sense_key_stats_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct Scsi_Host *shost = class_to_shost(dev);
+	struct mpi3mr_ioc *mrioc = shost_priv(shost);
+	ssize_t len = 0;
+	u64 count;
+	u16 i, key;
+
+	for (key = 0; key < MPI3MR_NUM_SENSE_KEYS; key++) {
+		count = 0;
+		for (i = 0; i < mrioc->num_op_reply_q; i++)
+			count += mrioc->op_reply_qinfo[i].sense_keys[key];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+		    "sense_key=0x%x count=%llu\n", key, count);
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(sense_key_stats);
+
+static struct device_attribute *mpi3mr_host_attrs[] = {
+	&dev_attr_reset_history,
+	&dev_attr_reply_queue_stats,
+	&dev_attr_sense_key_stats,
+	NULL,
+};
+
+/**
+ * mpi3mr_ncq_prio_supp - Check ncq priority is supported
+ * @sdev: SCSI device reference
+ *
+ * Check whether the SATA device behind the controller supports
+ * NCQ priority from the ATA IDENTIFY data in the ATA Information
+ * VPD page.
+ *
+ * Return: true if NCQ priority is supported, else false.
+ */
+static bool mpi3mr_ncq_prio_supp(struct scsi_device *sdev)
+{
+	unsigned char *buf;
+	bool ncq_prio_supp = false;
+
+	if (!scsi_device_supports_vpd(sdev))
+		return ncq_prio_supp;
+
+	buf = kmalloc(SCSI_VPD_PG_LEN, GFP_KERNEL);
+	if (!buf)
+		return ncq_prio_supp;
+
+	/* IDENTIFY word 76 bit 12: NCQ priority supported */
+	if (!scsi_get_vpd_page(sdev, 0x89, buf, SCSI_VPD_PG_LEN))
+		ncq_prio_supp = (buf[213] >> 4) & 1;
+
+	kfree(buf);
+	return ncq_prio_supp;
+}
+
+/**
+ * sas_ncq_prio_supported_show - Indicate if device supports NCQ priority
+ * @dev: pointer to embedded device
+ * @attr: sas_ncq_prio_supported attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' sdev attribute, only works with SATA devices
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+sas_ncq_prio_supported_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct scsi_device *sdev = to_scsi_device(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", mpi3mr_ncq_prio_supp(sdev));
+}
+static DEVICE_ATTR_RO(sas_ncq_prio_supported);
+
+/**
+ * sas_ncq_prio_enable_show - Send prioritized io commands to device
+ * @dev: pointer to embedded device
+ * @attr: sas_ncq_prio_enable attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read/write' sdev attribute, only works with SATA devices
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+sas_ncq_prio_enable_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct scsi_device *sdev = to_scsi_device(dev);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+
+	if (!sdev_priv_data)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE, "%d\n",
+	    sdev_priv_data->ncq_prio_enable);
+}
+
+/**
+ * sas_ncq_prio_enable_store - Enable or disable NCQ priority
+ * @dev: pointer to embedded device
+ * @attr: sas_ncq_prio_enable attribute descriptor
+ * @buf: the buffer holding the new value
+ * @count: size of the buffer
+ *
+ * Enabling is refused for devices which do not support NCQ
+ * priority.
+ *
+ * Return: count on success, -EINVAL on invalid input
+ */
+static ssize_t
+sas_ncq_prio_enable_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct scsi_device *sdev = to_scsi_device(dev);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	bool ncq_prio_enable = 0;
+
+	if (!sdev_priv_data)
+		return -ENXIO;
+
+	if (kstrtobool(buf, &ncq_prio_enable))
+		return -EINVAL;
+
+	if (ncq_prio_enable && !mpi3mr_ncq_prio_supp(sdev))
+		return -EINVAL;
+
+	sdev_priv_data->ncq_prio_enable = ncq_prio_enable;
+
+	return strlen(buf);
+}
+static DEVICE_ATTR_RW(sas_ncq_prio_enable);
+
+/**
+ * actuator_ranges_show - Concurrent positioning ranges display
+ * @dev: pointer to embedded device
+ * @attr: actuator_ranges attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' sdev attribute to display the first LBA
+ * and the number of LBAs served by each actuator of a multi
+ * actuator drive, one range per line.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+actuator_ranges_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct scsi_device *sdev = to_scsi_device(dev);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	ssize_t len = 0;
+	int i;
+
+	if (!sdev_priv_data)
+		return 0;
+
+	for (i = 0; i < sdev_priv_data->num_actuators; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d %llu %llu\n",
+		    i, sdev_priv_data->actuator_range[i].start_lba,
+		    sdev_priv_data->actuator_range[i].num_lbas);
+
+	return len;
+}
+static DEVICE_ATTR_RO(actuator_ranges);
+
+/**
+ * mpi3mr_sdev_tgtdev - Target device of a SCSI device
+ * @sdev: SCSI device reference
+ *
+ * The target device is referenced by the SCSI target private
+ * data for the lifetime of the SCSI target.
+ *
+ * Return: Target device reference or NULL.
+ */
+static struct mpi3mr_tgt_dev *mpi3mr_sdev_tgtdev(struct scsi_device *sdev)
+{
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+
+	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data)
+		return NULL;
+
+	return sdev_priv_data->tgt_priv_data->tgt_dev;
+}
+
+/**
+ * mpi3mr_tm_timeout_store - Set TM timeout override of a device
+ * @sdev: SCSI device reference
+ * @buf: the buffer holding the new value
+ * @abort: Abort TM timeout if true, reset TM timeout if false
+ *
+ * Return: 0 on success, -EINVAL on invalid input, -ENXIO if the
+ * device is gone.
+ */
+static int mpi3mr_tm_timeout_store(struct scsi_device *sdev,
+	const char *buf, bool abort)
+{
+	struct mpi3mr_tgt_dev *tgtdev = mpi3mr_sdev_tgtdev(sdev);
+	u8 timeout;
+
+	if (!tgtdev)
+		return -ENXIO;
+
+	if (kstrtou8(buf, 0, &timeout))
+		return -EINVAL;
+
+	if (abort)
+		tgtdev->abort_to = timeout;
+	else
+		tgtdev->reset_to = timeout;
+
+	return 0;
+}
+
+/**
+ * abort_tm_timeout_show - Abort TM timeout display
+ * @dev: pointer to embedded device
+ * @attr: abort_tm_timeout attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read/write' sdev attribute to display the abort task
+ * management timeout in seconds in use for the device.  Writing
+ * a non zero value overrides the timeout, writing 0 restores the
+ * device class default.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+abort_tm_timeout_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct mpi3mr_tgt_dev *tgtdev = mpi3mr_sdev_tgtdev(to_scsi_device(dev));
+
+	if (!tgtdev)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n",
+	    mpi3mr_tgtdev_tm_timeout(tgtdev, true, MPI3MR_ABORTTM_TIMEOUT));
+}
+
+static ssize_t
+abort_tm_timeout_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	int retval = mpi3mr_tm_timeout_store(to_scsi_device(dev), buf, true);
+
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(abort_tm_timeout);
+
+/**
+ * reset_tm_timeout_show - Reset TM timeout display
+ * @dev: pointer to embedded device
+ * @attr: reset_tm_timeout attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read/write' sdev attribute to display the target and
+ * LUN reset task management timeout in seconds in use for the
+ * device.  Writing a non zero value overrides the timeout,
+ * writing 0 restores the device class default.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+reset_tm_timeout_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct mpi3mr_tgt_dev *tgtdev = mpi3mr_sdev_tgtdev(to_scsi_device(dev));
+
+	if (!tgtdev)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n",
+	    mpi3mr_tgtdev_tm_timeout(tgtdev, false, MPI3MR_RESETTM_TIMEOUT));
+}
+
+static ssize_t
+reset_tm_timeout_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	int retval = mpi3mr_tm_timeout_store(to_scsi_device(dev), buf, false);
+
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(reset_tm_timeout);
+
+/**
+ * io_share_stats_show - Controller I/O budget share of a device
+ * @dev: pointer to embedded device
+ * @attr: device attribute
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' sdev attribute to display the I/Os the
+ * LUN has outstanding, its current fair share of the controller
+ * I/O budget and the number of I/Os issued beyond or deferred
+ * for exceeding the share.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+io_share_stats_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct scsi_device *sdev = to_scsi_device(dev);
+	struct mpi3mr_ioc *mrioc = shost_priv(sdev->host);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	int active, share;
+
+	if (!sdev_priv_data)
+		return 0;
+
+	active = max_t(int, READ_ONCE(mrioc->io_active_luns), 1);
+	share = max_t(int, mrioc->max_host_ios / active, MPI3MR_IO_SHARE_MIN);
+
+	return snprintf(buf, PAGE_SIZE,
+	    "outstanding=%d share=%d borrowed=%lld throttled=%lld\n",
+	    atomic_read(&sdev->device_busy), share,
+	    (long long)atomic64_read(&sdev_priv_data->io_borrowed),
+	    (long long)atomic64_read(&sdev_priv_data->io_throttled));
+}
+static DEVICE_ATTR_RO(io_share_stats);
+
+/**
+ * queue_depth_changes_show - Queue depth change count display
+ * @dev: pointer to embedded device
+ * @attr: queue_depth_changes attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' sdev attribute to display the number of
+ * queue depth changes applied to the target of the device after
+ * firmware reported a new queue depth or volume state.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+queue_depth_changes_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct mpi3mr_tgt_dev *tgtdev = mpi3mr_sdev_tgtdev(to_scsi_device(dev));
+
+	if (!tgtdev)
+		return 0;
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", tgtdev->qd_changes);
+}
+static DEVICE_ATTR_RO(queue_depth_changes);
+
+/**
+ * vd_state_stats_show - Volume state time display
+ * @dev: pointer to embedded device
+ * @attr: vd_state_stats attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' sdev attribute to display the current state
+ * of a volume and the time in milliseconds the volume spent in
+ * each state.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+vd_state_stats_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct mpi3mr_tgt_dev *tgtdev = mpi3mr_sdev_tgtdev(to_scsi_device(dev));
+	struct tgt_dev_volume *vol_inf;
+	u64 state_time[MPI3MR_VD_STATE_COUNT];
+
+	if (!tgtdev || tgtdev->dev_type != MPI3_DEVICE_DEVFORM_VD)
+		return 0;
+
+	vol_inf = &tgtdev->dev_spec.vol_inf;
+	memcpy(state_time, vol_inf->state_time, sizeof(state_time));
+	if (vol_inf->state_ts && vol_inf->state < MPI3MR_VD_STATE_COUNT)
+		state_time[vol_inf->state] +=
+		    jiffies_to_msecs(jiffies - vol_inf->state_ts);
+
+	return snprintf(buf, PAGE_SIZE,
+	    "state=%s optimal_ms=%llu partially_degraded_ms=%llu degraded_ms=%llu offline_ms=%llu\n",
+	    mpi3mr_vd_state_name(vol_inf->state),
+	    state_time[MPI3_DEVICE0_VD_STATE_OPTIMAL],
+	    state_time[MPI3_DEVICE0_VD_STATE_PARTIALLY_DEGRADED],
+	    state_time[MPI3_DEVICE0_VD_STATE_DEGRADED],
+	    state_time[MPI3_DEVICE0_VD_STATE_OFFLINE]);
+}
+static DEVICE_ATTR_RO(vd_state_stats);
+
+/**
+ * internal_reset_stats_show - Internal device reset statistics
+ * @dev: pointer to embedded device
+ * @attr: internal_reset_stats attribute descriptor
+ * @buf: the buffer returned
+ *
+ * A sysfs 'read-only' sdev attribute to display the number of
+ * internal device resets done by the firmware on the target,
+ * whether one is in progress and their total and longest
+ * duration in milliseconds.
+ *
+ * Return: number of bytes printed in buf
+ */
+static ssize_t
+internal_reset_stats_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct scsi_device *sdev = to_scsi_device(dev);
+	struct mpi3mr_sdev_priv_data *sdev_priv_data = sdev->hostdata;
+	struct mpi3mr_stgt_priv_data *stgt_priv_data;
+
+	if (!sdev_priv_data || !sdev_priv_data->tgt_priv_data)
+		return 0;
+	stgt_priv_data = sdev_priv_data->tgt_priv_data;
+
+	return snprintf(buf, PAGE_SIZE,
+	    "count=%u in_progress=%u total_ms=%llu max_ms=%u\n",
+	    stgt_priv_data->int_reset_count,
+	    READ_ONCE(stgt_priv_data->int_reset_ts) ? 1 : 0,
+	    stgt_priv_data->int_reset_time, stgt_priv_data->int_reset_max);
+}
+static DEVICE_ATTR_RO(internal_reset_stats);
+
+static struct device_attribute *mpi3mr_dev_attrs[] = {
+	&dev_attr_sas_ncq_prio_supported,
+	&dev_attr_sas_ncq_prio_enable,
+	&dev_attr_actuator_ranges,
+	&dev_attr_abort_tm_timeout,
+	&dev_attr_reset_tm_timeout,
+	&dev_attr_io_share_stats,
+	&dev_attr_queue_depth_changes,
+	&dev_attr_vd_state_stats,
+	&dev_attr_internal_reset_stats,
+	NULL,
+};
+
 static struct scsi_host_template mpi3mr_driver_template = {
 	.module				= THIS_MODULE,
 	.name				= "MPI3 Storage Controller",
@@ -3581,6 +6040,7 @@ static struct scsi_host_template mpi3mr_driver_template = {
 	.scan_finished			= mpi3mr_scan_finished,
 	.scan_start			= mpi3mr_scan_start,
 	.change_queue_depth		= mpi3mr_change_queue_depth,
+	.eh_timed_out			= mpi3mr_eh_timed_out,
 	.eh_device_reset_handler	= mpi3mr_eh_dev_reset,
 	.eh_target_reset_handler	= mpi3mr_eh_target_reset,
 	.eh_host_reset_handler		= mpi3mr_eh_host_reset,
@@ -3596,6 +6056,8 @@ static struct scsi_host_template mpi3mr_driver_template = {
 	.cmd_per_lun			= MPI3MR_MAX_CMDS_LUN,
 	.track_queue_depth		= 1,
 	.cmd_size			= sizeof(struct scmd_priv),
+	.shost_attrs			= mpi3mr_host_attrs,
+	.sdev_attrs			= mpi3mr_dev_attrs,
 };
 
 /**
@@ -3737,10 +6199,12 @@ mpi3mr_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	spin_lock_init(&mrioc->tgtdev_lock);
 	spin_lock_init(&mrioc->watchdog_lock);
 	spin_lock_init(&mrioc->chain_buf_lock);
+	spin_lock_init(&mrioc->reset_history_lock);
 
 	INIT_LIST_HEAD(&mrioc->fwevt_list);
 	INIT_LIST_HEAD(&mrioc->tgtdev_list);
 	INIT_LIST_HEAD(&mrioc->delayed_rmhs_list);
+	INIT_WORK(&mrioc->lost_io_work, mpi3mr_lost_io_work);
 
 	mutex_init(&mrioc->reset_mutex);
 	mpi3mr_init_drv_cmd(&mrioc->init_cmds, MPI3MR_HOSTTAG_INITCMDS);
@@ -3826,6 +6290,7 @@ mpi3mr_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	return retval;
 
 addhost_failed:
+	cancel_work_sync(&mrioc->lost_io_work);
 	mpi3mr_cleanup_ioc(mrioc, 0);
 out_iocinit_failed:
 	destroy_workqueue(mrioc->fwevt_worker_thread);
@@ -3863,6 +6328,8 @@ static void mpi3mr_remove(struct pci_dev *pdev)
 		ssleep(1);
 
 	mrioc->stop_drv_processing = 1;
+	mpi3mr_update_host_io_state(mrioc);
+	cancel_work_sync(&mrioc->lost_io_work);
 	mpi3mr_cleanup_fwevt_list(mrioc);
 	spin_lock_irqsave(&mrioc->fwevt_lock, flags);
 	wq = mrioc->fwevt_worker_thread;
@@ -3911,6 +6378,8 @@ static void mpi3mr_shutdown(struct pci_dev *pdev)
 		ssleep(1);
 
 	mrioc->stop_drv_processing = 1;
+	mpi3mr_update_host_io_state(mrioc);
+	cancel_work_sync(&mrioc->lost_io_work);
 	mpi3mr_cleanup_fwevt_list(mrioc);
 	spin_lock_irqsave(&mrioc->fwevt_lock, flags);
 	wq = mrioc->fwevt_worker_thread;
@@ -3945,6 +6414,8 @@ static int mpi3mr_suspend(struct pci_dev *pdev, pm_message_t state)
 	while (mrioc->reset_in_progress || mrioc->is_driver_loading)
 		ssleep(1);
 	mrioc->stop_drv_processing = 1;
+	mpi3mr_update_host_io_state(mrioc);
+	cancel_work_sync(&mrioc->lost_io_work);
 	mpi3mr_cleanup_fwevt_list(mrioc);
 	scsi_block_requests(shost);
 	mpi3mr_stop_watchdog(mrioc);
@@ -3996,6 +6467,7 @@ static int mpi3mr_resume(struct pci_dev *pdev)
 	}
 
 	mrioc->stop_drv_processing = 0;
+	mpi3mr_update_host_io_state(mrioc);
 	mpi3mr_init_ioc(mrioc, 1);
 	scsi_unblock_requests(shost);
 	mpi3mr_start_watchdog(mrioc);
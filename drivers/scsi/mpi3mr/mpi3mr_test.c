@@ -0,0 +1,406 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for the Broadcom MPI3 Storage Controllers driver
+ *
+ * Copyright (C) 2017-2021 Broadcom Inc.
+ *  (mailto: mpi3mr-linuxdrv.pdl@broadcom.com)
+ *
+ */
+
+#include <kunit/test.h>
+
+#include "mpi3mr.h"
+
+#define MPI3MR_TEST_NUM_SEGMENTS	2
+#define MPI3MR_TEST_SEGMENT_QD		4
+#define MPI3MR_TEST_QUEUE_DEPTH		\
+	(MPI3MR_TEST_NUM_SEGMENTS * MPI3MR_TEST_SEGMENT_QD)
+#define MPI3MR_TEST_REQ_SZ		128
+
+/**
+ * mpi3mr_test_post_reply - Emulate a firmware reply post
+ * @op_reply_q: Operational reply queue info
+ * @fw_pi: Firmware side producer index
+ * @fw_phase: Firmware side phase, toggled when the index wraps
+ *
+ * Write a reply descriptor carrying the firmware phase at the
+ * producer index, the way the controller posts completions.
+ *
+ * Return: Firmware producer index after the post.
+ */
+static u32 mpi3mr_test_post_reply(struct op_reply_qinfo *op_reply_q,
+	u32 fw_pi, u32 *fw_phase)
+{
+	struct mpi3_default_reply_descriptor *reply_desc;
+
+	reply_desc = mpi3mr_get_reply_desc(op_reply_q, fw_pi);
+	reply_desc->reply_flags = cpu_to_le16(*fw_phase &
+	    MPI3_REPLY_DESCRIPT_FLAGS_PHASE_MASK);
+
+	return mpi3mr_reply_ci_next(fw_pi, op_reply_q->num_replies, fw_phase);
+}
+
+static struct op_reply_qinfo *mpi3mr_test_alloc_reply_q(struct kunit *test)
+{
+	struct op_reply_qinfo *op_reply_q;
+	int i;
+
+	op_reply_q = kunit_kzalloc(test, sizeof(*op_reply_q), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, op_reply_q);
+	op_reply_q->q_segments = kunit_kcalloc(test,
+	    MPI3MR_TEST_NUM_SEGMENTS, sizeof(struct segments), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, op_reply_q->q_segments);
+	for (i = 0; i < MPI3MR_TEST_NUM_SEGMENTS; i++) {
+		op_reply_q->q_segments[i].segment = kunit_kcalloc(test,
+		    MPI3MR_TEST_SEGMENT_QD,
+		    sizeof(struct mpi3_default_reply_descriptor), GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+		    op_reply_q->q_segments[i].segment);
+	}
+	op_reply_q->num_segments = MPI3MR_TEST_NUM_SEGMENTS;
+	op_reply_q->segment_qd = MPI3MR_TEST_SEGMENT_QD;
+	op_reply_q->num_replies = MPI3MR_TEST_QUEUE_DEPTH;
+	op_reply_q->ephase = 1;
+
+	return op_reply_q;
+}
+
+/**
+ * struct mpi3mr_test_ioc - Adapter instance with a register file
+ * @mrioc: Adapter instance handed to the driver
+ * @regs: Software copy of the system interface registers
+ * @num_writes: Number of register writes issued by the driver
+ */
+struct mpi3mr_test_ioc {
+	struct mpi3mr_ioc mrioc;
+	u32 regs[sizeof(struct mpi3_sysif_registers) / sizeof(u32)];
+	u32 num_writes;
+};
+
+static u32 *mpi3mr_test_reg(struct mpi3mr_ioc *mrioc, u32 offset)
+{
+	struct mpi3mr_test_ioc *tioc =
+	    container_of(mrioc, struct mpi3mr_test_ioc, mrioc);
+
+	return &tioc->regs[offset / sizeof(u32)];
+}
+
+static u32 mpi3mr_test_readl(struct mpi3mr_ioc *mrioc, u32 offset)
+{
+	return *mpi3mr_test_reg(mrioc, offset);
+}
+
+static void mpi3mr_test_writel(struct mpi3mr_ioc *mrioc, u32 offset, u32 val)
+{
+	*mpi3mr_test_reg(mrioc, offset) = val;
+	container_of(mrioc, struct mpi3mr_test_ioc, mrioc)->num_writes++;
+}
+
+static u64 mpi3mr_test_readq(struct mpi3mr_ioc *mrioc, u32 offset)
+{
+	u32 *reg = mpi3mr_test_reg(mrioc, offset);
+
+	return ((u64)reg[1] << 32) | reg[0];
+}
+
+static void mpi3mr_test_writeq(struct mpi3mr_ioc *mrioc, u32 offset, u64 val)
+{
+	u32 *reg = mpi3mr_test_reg(mrioc, offset);
+
+	reg[0] = lower_32_bits(val);
+	reg[1] = upper_32_bits(val);
+	container_of(mrioc, struct mpi3mr_test_ioc, mrioc)->num_writes++;
+}
+
+static const struct mpi3mr_sysif_ops mpi3mr_test_sysif_ops = {
+	.readl = mpi3mr_test_readl,
+	.writel = mpi3mr_test_writel,
+	.readq = mpi3mr_test_readq,
+	.writeq = mpi3mr_test_writeq,
+};
+
+/**
+ * mpi3mr_test_alloc_ioc - Set up an adapter with one queue pair
+ * @test: KUnit test context
+ *
+ * Allocate an adapter instance whose system interface registers
+ * are emulated in memory, with one operational request queue and
+ * its reply queue backed by segmented host memory.
+ *
+ * Return: Test adapter instance.
+ */
+static struct mpi3mr_test_ioc *mpi3mr_test_alloc_ioc(struct kunit *test)
+{
+	struct mpi3mr_test_ioc *tioc;
+	struct mpi3mr_ioc *mrioc;
+	struct op_req_qinfo *op_req_q;
+	int i;
+
+	tioc = kunit_kzalloc(test, sizeof(*tioc), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, tioc);
+	mrioc = &tioc->mrioc;
+	snprintf(mrioc->name, sizeof(mrioc->name), "mpi3mr_test");
+	mrioc->sysif_ops = &mpi3mr_test_sysif_ops;
+	mrioc->facts.op_req_sz = MPI3MR_TEST_REQ_SZ;
+	mrioc->max_host_ios = MPI3MR_TEST_QUEUE_DEPTH;
+
+	op_req_q = kunit_kzalloc(test, sizeof(*op_req_q), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, op_req_q);
+	op_req_q->q_segments = kunit_kcalloc(test,
+	    MPI3MR_TEST_NUM_SEGMENTS, sizeof(struct segments), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, op_req_q->q_segments);
+	for (i = 0; i < MPI3MR_TEST_NUM_SEGMENTS; i++) {
+		op_req_q->q_segments[i].segment = kunit_kzalloc(test,
+		    MPI3MR_TEST_SEGMENT_QD * MPI3MR_TEST_REQ_SZ, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test,
+		    op_req_q->q_segments[i].segment);
+	}
+	op_req_q->num_segments = MPI3MR_TEST_NUM_SEGMENTS;
+	op_req_q->segment_qd = MPI3MR_TEST_SEGMENT_QD;
+	op_req_q->num_requests = MPI3MR_TEST_QUEUE_DEPTH;
+	op_req_q->qid = 1;
+	op_req_q->reply_qid = 1;
+	spin_lock_init(&op_req_q->q_lock);
+	mrioc->req_qinfo = op_req_q;
+	mrioc->num_op_req_q = 1;
+
+	mrioc->op_reply_qinfo = mpi3mr_test_alloc_reply_q(test);
+	mrioc->op_reply_qinfo->qid = 1;
+	mrioc->num_op_reply_q = 1;
+
+	mrioc->intr_info = kunit_kzalloc(test, sizeof(*mrioc->intr_info),
+	    GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mrioc->intr_info);
+	mrioc->intr_info->mrioc = mrioc;
+	mrioc->intr_info->op_reply_q = mrioc->op_reply_qinfo;
+	mrioc->intr_info_count = 1;
+
+	return tioc;
+}
+
+static void mpi3mr_test_req_qfull(struct kunit *test)
+{
+	struct op_req_qinfo op_req_q = {
+		.num_requests = MPI3MR_TEST_QUEUE_DEPTH,
+	};
+
+	/* Empty queue */
+	op_req_q.pi = 0;
+	op_req_q.ci = 0;
+	KUNIT_EXPECT_FALSE(test, mpi3mr_check_req_qfull(&op_req_q));
+
+	/* One slot is always left unused to tell full from empty */
+	op_req_q.pi = MPI3MR_TEST_QUEUE_DEPTH - 2;
+	KUNIT_EXPECT_FALSE(test, mpi3mr_check_req_qfull(&op_req_q));
+	op_req_q.pi = MPI3MR_TEST_QUEUE_DEPTH - 1;
+	KUNIT_EXPECT_TRUE(test, mpi3mr_check_req_qfull(&op_req_q));
+
+	/* Full with the producer index wrapped behind the consumer */
+	op_req_q.ci = 3;
+	op_req_q.pi = 2;
+	KUNIT_EXPECT_TRUE(test, mpi3mr_check_req_qfull(&op_req_q));
+	op_req_q.pi = 3;
+	KUNIT_EXPECT_FALSE(test, mpi3mr_check_req_qfull(&op_req_q));
+	op_req_q.pi = 1;
+	KUNIT_EXPECT_FALSE(test, mpi3mr_check_req_qfull(&op_req_q));
+}
+
+static void mpi3mr_test_req_entry_segments(struct kunit *test)
+{
+	struct segments segments[MPI3MR_TEST_NUM_SEGMENTS];
+	struct op_req_qinfo op_req_q = {
+		.num_requests = MPI3MR_TEST_QUEUE_DEPTH,
+		.num_segments = MPI3MR_TEST_NUM_SEGMENTS,
+		.segment_qd = MPI3MR_TEST_SEGMENT_QD,
+		.q_segments = segments,
+	};
+	u8 *seg0, *seg1;
+
+	seg0 = kunit_kzalloc(test,
+	    MPI3MR_TEST_SEGMENT_QD * MPI3MR_TEST_REQ_SZ, GFP_KERNEL);
+	seg1 = kunit_kzalloc(test,
+	    MPI3MR_TEST_SEGMENT_QD * MPI3MR_TEST_REQ_SZ, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, seg0);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, seg1);
+	segments[0].segment = seg0;
+	segments[1].segment = seg1;
+
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_req_entry(&op_req_q, 0,
+	    MPI3MR_TEST_REQ_SZ), seg0);
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_req_entry(&op_req_q,
+	    MPI3MR_TEST_SEGMENT_QD - 1, MPI3MR_TEST_REQ_SZ),
+	    seg0 + (MPI3MR_TEST_SEGMENT_QD - 1) * MPI3MR_TEST_REQ_SZ);
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_req_entry(&op_req_q,
+	    MPI3MR_TEST_SEGMENT_QD, MPI3MR_TEST_REQ_SZ), seg1);
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_req_entry(&op_req_q,
+	    MPI3MR_TEST_QUEUE_DEPTH - 1, MPI3MR_TEST_REQ_SZ),
+	    seg1 + (MPI3MR_TEST_SEGMENT_QD - 1) * MPI3MR_TEST_REQ_SZ);
+}
+
+static void mpi3mr_test_reply_desc_segments(struct kunit *test)
+{
+	struct op_reply_qinfo *op_reply_q = mpi3mr_test_alloc_reply_q(test);
+	struct mpi3_default_reply_descriptor *seg0, *seg1;
+
+	seg0 = op_reply_q->q_segments[0].segment;
+	seg1 = op_reply_q->q_segments[1].segment;
+
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_reply_desc(op_reply_q, 0), seg0);
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_reply_desc(op_reply_q,
+	    MPI3MR_TEST_SEGMENT_QD - 1), seg0 + MPI3MR_TEST_SEGMENT_QD - 1);
+	KUNIT_EXPECT_PTR_EQ(test, mpi3mr_get_reply_desc(op_reply_q,
+	    MPI3MR_TEST_SEGMENT_QD), seg1);
+}
+
+static void mpi3mr_test_reply_q_empty(struct kunit *test)
+{
+	struct op_reply_qinfo *op_reply_q = mpi3mr_test_alloc_reply_q(test);
+
+	/* Zeroed queue memory carries phase 0 and must read as empty */
+	KUNIT_EXPECT_FALSE(test, mpi3mr_reply_desc_valid(
+	    mpi3mr_get_reply_desc(op_reply_q, 0), op_reply_q->ephase));
+}
+
+static void mpi3mr_test_reply_ci_next(struct kunit *test)
+{
+	u32 phase = 1;
+	u32 ci;
+
+	ci = mpi3mr_reply_ci_next(0, MPI3MR_TEST_QUEUE_DEPTH, &phase);
+	KUNIT_EXPECT_EQ(test, ci, 1U);
+	KUNIT_EXPECT_EQ(test, phase, 1U);
+
+	ci = mpi3mr_reply_ci_next(MPI3MR_TEST_QUEUE_DEPTH - 1,
+	    MPI3MR_TEST_QUEUE_DEPTH, &phase);
+	KUNIT_EXPECT_EQ(test, ci, 0U);
+	KUNIT_EXPECT_EQ(test, phase, 0U);
+
+	ci = mpi3mr_reply_ci_next(MPI3MR_TEST_QUEUE_DEPTH - 1,
+	    MPI3MR_TEST_QUEUE_DEPTH, &phase);
+	KUNIT_EXPECT_EQ(test, ci, 0U);
+	KUNIT_EXPECT_EQ(test, phase, 1U);
+}
+
+static void mpi3mr_test_reply_phase_wrap(struct kunit *test)
+{
+	struct op_reply_qinfo *op_reply_q = mpi3mr_test_alloc_reply_q(test);
+	u32 fw_pi = 0, fw_phase = 1;
+	int i;
+
+	/* Fill the whole queue in the first pass */
+	for (i = 0; i < MPI3MR_TEST_QUEUE_DEPTH; i++)
+		fw_pi = mpi3mr_test_post_reply(op_reply_q, fw_pi, &fw_phase);
+	KUNIT_EXPECT_EQ(test, fw_pi, 0U);
+	KUNIT_EXPECT_EQ(test, fw_phase, 0U);
+	for (i = 0; i < MPI3MR_TEST_QUEUE_DEPTH; i++)
+		KUNIT_EXPECT_TRUE(test, mpi3mr_reply_desc_valid(
+		    mpi3mr_get_reply_desc(op_reply_q, i), 1));
+
+	/* Stale descriptors from the first pass must not match phase 0 */
+	for (i = 0; i < MPI3MR_TEST_QUEUE_DEPTH; i++)
+		KUNIT_EXPECT_FALSE(test, mpi3mr_reply_desc_valid(
+		    mpi3mr_get_reply_desc(op_reply_q, i), 0));
+
+	/* Second pass crossing the segment boundary with toggled phase */
+	for (i = 0; i < MPI3MR_TEST_SEGMENT_QD + 1; i++)
+		fw_pi = mpi3mr_test_post_reply(op_reply_q, fw_pi, &fw_phase);
+	for (i = 0; i < MPI3MR_TEST_SEGMENT_QD + 1; i++)
+		KUNIT_EXPECT_TRUE(test, mpi3mr_reply_desc_valid(
+		    mpi3mr_get_reply_desc(op_reply_q, i), 0));
+	KUNIT_EXPECT_FALSE(test, mpi3mr_reply_desc_valid(
+	    mpi3mr_get_reply_desc(op_reply_q, MPI3MR_TEST_SEGMENT_QD + 1), 0));
+}
+
+static void mpi3mr_test_op_request_post(struct kunit *test)
+{
+	struct mpi3mr_test_ioc *tioc = mpi3mr_test_alloc_ioc(test);
+	struct mpi3mr_ioc *mrioc = &tioc->mrioc;
+	struct op_req_qinfo *op_req_q = mrioc->req_qinfo;
+	u32 pi_reg = MPI3MR_SYSIF_REG(oper_queue_indexes[0].producer_index);
+	u8 req[MPI3MR_ADMIN_REQ_FRAME_SZ];
+	u32 seq;
+	int i;
+
+	/*
+	 * Each post copies the frame, stamps the next sequence number and
+	 * rings the doorbell with the PI.
+	 */
+	for (i = 0; i < MPI3MR_TEST_QUEUE_DEPTH - 1; i++) {
+		memset(req, i + 1, sizeof(req));
+		seq = 0;
+		KUNIT_ASSERT_EQ(test,
+		    mpi3mr_op_request_post(mrioc, op_req_q, req, &seq), 0);
+		KUNIT_EXPECT_EQ(test, seq, (u32)(i + 1));
+		KUNIT_EXPECT_EQ(test, memcmp(mpi3mr_get_req_entry(op_req_q, i,
+		    MPI3MR_TEST_REQ_SZ), req, sizeof(req)), 0);
+		KUNIT_EXPECT_EQ(test, tioc->regs[pi_reg / sizeof(u32)],
+		    (u32)(i + 1));
+		KUNIT_EXPECT_EQ(test,
+		    atomic_read(&mrioc->op_reply_qinfo->pend_ios), i + 1);
+	}
+	KUNIT_EXPECT_EQ(test, tioc->num_writes,
+	    (u32)(MPI3MR_TEST_QUEUE_DEPTH - 1));
+}
+
+static void mpi3mr_test_op_request_post_full(struct kunit *test)
+{
+	struct mpi3mr_test_ioc *tioc = mpi3mr_test_alloc_ioc(test);
+	struct mpi3mr_ioc *mrioc = &tioc->mrioc;
+	struct op_req_qinfo *op_req_q = mrioc->req_qinfo;
+	u32 pi_reg = MPI3MR_SYSIF_REG(oper_queue_indexes[0].producer_index);
+	u8 req[MPI3MR_ADMIN_REQ_FRAME_SZ] = { 0 };
+	u32 num_writes, seq = 0;
+	int i;
+
+	for (i = 0; i < MPI3MR_TEST_QUEUE_DEPTH - 1; i++)
+		KUNIT_ASSERT_EQ(test,
+		    mpi3mr_op_request_post(mrioc, op_req_q, req, NULL), 0);
+
+	/*
+	 * With no completions posted to the reply queue the full request
+	 * queue stays full, the post is refused without a doorbell.
+	 */
+	num_writes = tioc->num_writes;
+	KUNIT_EXPECT_EQ(test,
+	    mpi3mr_op_request_post(mrioc, op_req_q, req, &seq), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, tioc->num_writes, num_writes);
+	KUNIT_EXPECT_EQ(test, seq, 0U);
+	KUNIT_EXPECT_EQ(test, op_req_q->pi,
+	    (u16)(MPI3MR_TEST_QUEUE_DEPTH - 1));
+
+	/* Once the firmware consumed requests the PI wraps to zero */
+	op_req_q->ci = 2;
+	op_req_q->io_seq = U32_MAX;
+	KUNIT_EXPECT_EQ(test,
+	    mpi3mr_op_request_post(mrioc, op_req_q, req, &seq), 0);
+	KUNIT_EXPECT_EQ(test, tioc->regs[pi_reg / sizeof(u32)], 0U);
+	/* The sequence number wraps past zero, which marks "not posted" */
+	KUNIT_EXPECT_EQ(test, seq, 1U);
+	KUNIT_EXPECT_EQ(test,
+	    mpi3mr_op_request_post(mrioc, op_req_q, req, NULL), 0);
+	KUNIT_EXPECT_EQ(test, tioc->regs[pi_reg / sizeof(u32)], 1U);
+	KUNIT_EXPECT_EQ(test,
+	    mpi3mr_op_request_post(mrioc, op_req_q, req, NULL), -EAGAIN);
+}
+
+static struct kunit_case mpi3mr_ring_test_cases[] = {
+	KUNIT_CASE(mpi3mr_test_req_qfull),
+	KUNIT_CASE(mpi3mr_test_req_entry_segments),
+	KUNIT_CASE(mpi3mr_test_reply_desc_segments),
+	KUNIT_CASE(mpi3mr_test_reply_q_empty),
+	KUNIT_CASE(mpi3mr_test_reply_ci_next),
+	KUNIT_CASE(mpi3mr_test_reply_phase_wrap),
+	KUNIT_CASE(mpi3mr_test_op_request_post),
+	KUNIT_CASE(mpi3mr_test_op_request_post_full),
+	{}
+};
+
+static struct kunit_suite mpi3mr_ring_test_suite = {
+	.name = "mpi3mr_ring",
+	.test_cases = mpi3mr_ring_test_cases,
+};
+
+kunit_test_suite(mpi3mr_ring_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the MPI3 driver queue helpers");
+MODULE_LICENSE("GPL");